@@ -0,0 +1,329 @@
+#include <async_decoder.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <istream>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "read_queue.h"
+
+namespace {
+
+struct Chunk {
+    // Set when the read is issued, null again once the decoder is done with it.
+    uint8_t *buffer = nullptr;
+    // Expected size until the read completes, then the size actually read.
+    size_t size = 0;
+    bool ready = false;
+};
+
+struct FileJob {
+    ~FileJob() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int fd = -1;
+    std::vector<Chunk> chunks;
+    size_t submitted = 0;
+    // The decoder has finished, reads not issued yet are dropped.
+    bool abandoned = false;
+    bool io_error = false;
+    std::function<void(DecodeResult)> callback;
+};
+
+}  // namespace
+
+class AsyncDecoder::Impl {
+public:
+    explicit Impl(const AsyncDecodeOptions &options)
+        : buffer_size_(options.buffer_size),
+          buffers_(new uint8_t[options.buffer_size * options.buffer_count]),
+          slots_(options.buffer_count) {
+        if (options.use_io_uring) {
+            queue_ = MakeIoUringQueue(options.buffer_count);
+        }
+        if (!queue_) {
+            queue_ = MakePreadQueue();
+        }
+        for (size_t id = options.buffer_count; id > 0; --id) {
+            free_.push_back(id - 1);
+        }
+        try {
+            io_thread_ = std::thread(&Impl::IoLoop, this);
+            for (size_t id = 0; id < options.decode_threads; ++id) {
+                decoders_.emplace_back(&Impl::DecodeLoop, this);
+            }
+        } catch (...) {
+            Stop();
+            throw;
+        }
+    }
+
+    ~Impl() {
+        Stop();
+    }
+
+    void Submit(const std::string &path, std::function<void(DecodeResult)> callback) {
+        auto job = std::make_shared<FileJob>();
+        job->callback = std::move(callback);
+        job->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (job->fd >= 0 && fstat(job->fd, &info) == 0) {
+            size_t file_size = info.st_size;
+            job->chunks.resize((file_size + buffer_size_ - 1) / buffer_size_);
+            for (size_t id = 0; id < job->chunks.size(); ++id) {
+                job->chunks[id].size = std::min(buffer_size_, file_size - id * buffer_size_);
+            }
+        } else {
+            job->io_error = true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!job->chunks.empty()) {
+                reading_.push_back(job);
+            }
+            decoding_.push_back(job);
+        }
+        io_cv_.notify_one();
+        decode_cv_.notify_one();
+    }
+
+    bool UsesIoUring() const {
+        return queue_->UsesIoUring();
+    }
+
+private:
+    class ChunkStreamBuf;
+
+    struct Slot {
+        std::shared_ptr<FileJob> job;
+        size_t chunk = 0;
+    };
+
+    // Joins the decoders first, they may still wait for reads.
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_decoders_ = true;
+        }
+        decode_cv_.notify_all();
+        for (auto &decoder : decoders_) {
+            decoder.join();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_io_ = true;
+        }
+        io_cv_.notify_all();
+        if (io_thread_.joinable()) {
+            io_thread_.join();
+        }
+    }
+
+    // Called with the lock held.
+    void Release(Chunk &chunk) {
+        if (chunk.buffer != nullptr) {
+            free_.push_back((chunk.buffer - buffers_.get()) / buffer_size_);
+            chunk.buffer = nullptr;
+            io_cv_.notify_one();
+        }
+    }
+
+    // Gives chunk |id| of |job| to its decoder once it is read, and takes back
+    // the previous one. Returns false at the end of the file.
+    bool NextChunk(FileJob &job, size_t id, const uint8_t *&data, size_t &size) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (id > 0 && id <= job.chunks.size()) {
+            Release(job.chunks[id - 1]);
+        }
+        if (id >= job.chunks.size()) {
+            return false;
+        }
+        auto &chunk = job.chunks[id];
+        chunk_cv_.wait(lock, [&] { return chunk.ready; });
+        data = chunk.buffer;
+        size = chunk.size;
+        return size != 0;
+    }
+
+    void IoLoop() {
+        std::vector<ReadRequest> requests;
+        std::vector<ReadCompletion> completions;
+        size_t in_flight = 0;
+        while (true) {
+            requests.clear();
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                io_cv_.wait(lock, [&] {
+                    return in_flight > 0 || stop_io_ || (!free_.empty() && !reading_.empty());
+                });
+                if (in_flight == 0 && stop_io_) {
+                    return;
+                }
+                // Buffers go to files strictly in submission order, so a file
+                // never waits for buffers held by the files queued after it.
+                while (!free_.empty() && !reading_.empty()) {
+                    auto &job = reading_.front();
+                    if (job->abandoned || job->submitted == job->chunks.size()) {
+                        reading_.pop_front();
+                        continue;
+                    }
+                    size_t id = job->submitted++;
+                    size_t buffer = free_.back();
+                    free_.pop_back();
+                    auto &chunk = job->chunks[id];
+                    chunk.buffer = buffers_.get() + buffer * buffer_size_;
+                    slots_[buffer] = {job, id};
+                    requests.push_back(
+                        {job->fd, id * buffer_size_, chunk.buffer, chunk.size, buffer});
+                }
+            }
+            for (const auto &request : requests) {
+                queue_->Submit(request);
+            }
+            in_flight += requests.size();
+            if (in_flight == 0) {
+                continue;
+            }
+
+            completions.clear();
+            queue_->Wait(completions);
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto &completion : completions) {
+                auto slot = std::move(slots_[completion.tag]);
+                --in_flight;
+                auto &chunk = slot.job->chunks[slot.chunk];
+                if (completion.result < 0 || static_cast<size_t>(completion.result) < chunk.size) {
+                    slot.job->io_error = true;
+                }
+                chunk.size = std::max<ssize_t>(completion.result, 0);
+                chunk.ready = true;
+                if (slot.job->abandoned) {
+                    Release(chunk);
+                }
+            }
+            chunk_cv_.notify_all();
+        }
+    }
+
+    void DecodeLoop();
+
+    size_t buffer_size_;
+    std::unique_ptr<uint8_t[]> buffers_;
+    std::unique_ptr<ReadQueue> queue_;
+
+    std::mutex mutex_;
+    std::condition_variable io_cv_;
+    std::condition_variable chunk_cv_;
+    std::condition_variable decode_cv_;
+    // Indices of buffers not owned by any chunk.
+    std::vector<size_t> free_;
+    // Chunk waiting for the read into each buffer.
+    std::vector<Slot> slots_;
+    // Files with reads left to issue, in submission order.
+    std::deque<std::shared_ptr<FileJob>> reading_;
+    // Files waiting for a decoder, in submission order.
+    std::deque<std::shared_ptr<FileJob>> decoding_;
+    bool stop_decoders_ = false;
+    bool stop_io_ = false;
+
+    std::thread io_thread_;
+    std::vector<std::thread> decoders_;
+};
+
+// Input of one decoder: the chunks of its file in order, each handed back to
+// the buffer ring as soon as the next one is requested.
+class AsyncDecoder::Impl::ChunkStreamBuf : public std::streambuf {
+public:
+    ChunkStreamBuf(Impl &impl, FileJob &job) : impl_(impl), job_(job) {
+    }
+
+protected:
+    int_type underflow() override {
+        const uint8_t *data = nullptr;
+        size_t size = 0;
+        if (!impl_.NextChunk(job_, next_chunk_++, data, size)) {
+            return traits_type::eof();
+        }
+        auto *begin = reinterpret_cast<char *>(const_cast<uint8_t *>(data));
+        setg(begin, begin, begin + size);
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    Impl &impl_;
+    FileJob &job_;
+    size_t next_chunk_ = 0;
+};
+
+void AsyncDecoder::Impl::DecodeLoop() {
+    while (true) {
+        std::shared_ptr<FileJob> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            decode_cv_.wait(lock, [&] { return stop_decoders_ || !decoding_.empty(); });
+            if (decoding_.empty()) {
+                return;
+            }
+            job = std::move(decoding_.front());
+            decoding_.pop_front();
+        }
+
+        DecodeResult result;
+        if (job->fd >= 0) {
+            ChunkStreamBuf buffer(*this, *job);
+            std::istream input(&buffer);
+            result = TryDecode(input);
+        } else {
+            result.status = DecodeStatus::kIoError;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job->abandoned = true;
+            for (auto &chunk : job->chunks) {
+                if (chunk.ready) {
+                    Release(chunk);
+                }
+            }
+            if (job->io_error && !result.Ok()) {
+                result.status = DecodeStatus::kIoError;
+            }
+        }
+        job->callback(std::move(result));
+    }
+}
+
+AsyncDecoder::AsyncDecoder(const AsyncDecodeOptions &options) {
+    if (options.buffer_size == 0 || options.buffer_count == 0 || options.decode_threads == 0) {
+        throw std::invalid_argument("Zero size in AsyncDecodeOptions");
+    }
+    impl_ = std::make_unique<Impl>(options);
+}
+
+AsyncDecoder::~AsyncDecoder() = default;
+
+void AsyncDecoder::Decode(const std::string &path, std::function<void(DecodeResult)> callback) {
+    impl_->Submit(path, std::move(callback));
+}
+
+std::future<DecodeResult> AsyncDecoder::Decode(const std::string &path) {
+    auto promise = std::make_shared<std::promise<DecodeResult>>();
+    auto future = promise->get_future();
+    impl_->Submit(path, [promise](DecodeResult result) { promise->set_value(std::move(result)); });
+    return future;
+}
+
+bool AsyncDecoder::UsesIoUring() const {
+    return impl_->UsesIoUring();
+}
@@ -1,65 +1,26 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <istream>
-#include <stdexcept>
 #include <glog/logging.h>
 
+// Byte reader for marker segments. Reading past the end does not throw: it
+// returns zeros and sets a sticky flag, so callers check Failed() once per
+// segment instead of once per byte.
 class BitReader {
 public:
     BitReader() = delete;
-    BitReader(std::istream& inp) : inp_(inp), bit_pos_(0) {
-    }
-
-    bool GetBit() {
-        if (bit_pos_ % 8 == 0) {
-            if (inp_.eof()) {
-                throw std::runtime_error("EOF in GetBit");
-            }
-            last_byte_ = inp_.get();
-            if (last_byte_ == 0xff) {
-                if (inp_.eof()) {
-                    throw std::runtime_error("EOF after 0xFF in GetBit");
-                }
-                if (inp_.peek() == 0) {
-                    inp_.get();
-                    bit_pos_ += 8;  // Will cause strange behavior
-                } else if (inp_.peek() == 0xd9) {
-                    throw std::runtime_error("0xFFD9 in GetBit");
-                } else {
-                    throw std::runtime_error("Bad byte after 0xFF in GetBit");
-                }
-            }
-        }
-        bool res = last_byte_ & (1u << (7 - bit_pos_ % 8));
-        ++bit_pos_;
-        return res;
-    }
-
-    bool CheckEndOfJpeg() {
-        if (inp_.eof()) {
-            throw std::runtime_error("EOF in CheckEndOfJpeg");
-        }
-        if (inp_.peek() == 0xff) {
-            inp_.get();
-            if (inp_.eof()) {
-                throw std::runtime_error("EOF in CheckEndOfJpeg");
-            }
-            auto byte = inp_.peek();
-            inp_.putback(static_cast<char>(0xff));
-            return byte == 0xd9;
-        } else {
-            return false;
-        }
+    BitReader(std::istream& inp) : inp_(inp), bit_pos_(0), last_byte_(0), failed_(false) {
     }
 
     uint8_t GetByte() {
-        if (bit_pos_ % 8 != 0) {
-            throw std::runtime_error("Bad bit pos in GetByte");
+        auto byte = inp_.get();
+        if (byte == std::istream::traits_type::eof()) {
+            failed_ = true;
+            byte = 0;
         }
-        if (inp_.eof()) {
-            throw std::runtime_error("EOF in GetByte");
-        }
-        last_byte_ = inp_.get();
+        last_byte_ = byte;
         bit_pos_ += 8;
         return last_byte_;
     }
@@ -69,28 +30,87 @@ public:
     }
 
     uint16_t GetDoubleByte() {
-        if (bit_pos_ % 8 != 0) {
-            throw std::runtime_error("Bad bit pos in GetDoubleByte");
-        }
-        uint16_t res = 0;
-        for (int cn = 0; cn < 2; ++cn) {
-            if (inp_.eof()) {
-                throw std::runtime_error("EOF in GetByte");
-            }
-            res <<= 8;
-            last_byte_ = inp_.get();
-            bit_pos_ += 8;
-            res ^= last_byte_;
-        }
-        return res;
+        uint16_t res = GetByte() << 8;
+        return res ^ GetByte();
     }
 
     size_t GetCurPos() {
         return bit_pos_;
     }
 
+    bool Failed() const {
+        return failed_;
+    }
+
+    // Reads up to |size| raw bytes, returns the number of bytes actually read.
+    size_t ReadChunk(uint8_t* data, size_t size) {
+        inp_.read(reinterpret_cast<char*>(data), size);
+        size_t cnt = inp_.gcount();
+        bit_pos_ += 8 * cnt;
+        return cnt;
+    }
+
 private:
     std::istream& inp_;
     size_t bit_pos_;
     unsigned char last_byte_;
-};
\ No newline at end of file
+    bool failed_;
+};
+
+// Bit reader over an in-memory entropy-coded segment with stuffing and markers
+// already removed. Bits past the end read as zeros, Overrun() reports that.
+class ScanBitReader {
+public:
+    ScanBitReader(const uint8_t *data, size_t size, size_t bit_pos = 0)
+        : data_(data), size_(size), byte_pos_(bit_pos / 8), buffer_(0), bits_left_(0) {
+        SkipBits(bit_pos % 8);
+    }
+
+    uint32_t PeekBits(int cnt) {
+        if (bits_left_ < cnt) {
+            Refill();
+        }
+        return buffer_ >> (64 - cnt);
+    }
+
+    void SkipBits(int cnt) {
+        if (bits_left_ < cnt) {
+            Refill();
+        }
+        buffer_ <<= cnt;
+        bits_left_ -= cnt;
+    }
+
+    uint32_t GetBits(int cnt) {
+        if (cnt == 0) {
+            return 0;
+        }
+        uint32_t res = PeekBits(cnt);
+        SkipBits(cnt);
+        return res;
+    }
+
+    size_t GetCurPos() const {
+        return byte_pos_ * 8 - bits_left_;
+    }
+
+    bool Overrun() const {
+        return GetCurPos() > size_ * 8;
+    }
+
+private:
+    void Refill() {
+        while (bits_left_ <= 56) {
+            uint64_t byte = byte_pos_ < size_ ? data_[byte_pos_] : 0;
+            ++byte_pos_;
+            buffer_ |= byte << (56 - bits_left_);
+            bits_left_ += 8;
+        }
+    }
+
+    const uint8_t *data_;
+    size_t size_;
+    size_t byte_pos_;
+    uint64_t buffer_;
+    int bits_left_;
+};
@@ -0,0 +1,80 @@
+#include <content_hash.h>
+
+namespace {
+
+const uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+const uint64_t kPrime3 = 0x165667B19E3779F9ull;
+const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ull;
+const uint64_t kPrime5 = 0x27D4EB2F165667C5ull;
+
+uint64_t RotateLeft(uint64_t value, int shift) {
+    return (value << shift) | (value >> (64 - shift));
+}
+
+// Little-endian loads, the hash must not depend on the host.
+uint64_t Load64(const uint8_t *data) {
+    uint64_t value = 0;
+    for (int id = 7; id >= 0; --id) {
+        value = (value << 8) | data[id];
+    }
+    return value;
+}
+
+uint32_t Load32(const uint8_t *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+uint64_t Round(uint64_t acc, uint64_t input) {
+    acc += input * kPrime2;
+    return RotateLeft(acc, 31) * kPrime1;
+}
+
+uint64_t MergeRound(uint64_t acc, uint64_t val) {
+    acc ^= Round(0, val);
+    return acc * kPrime1 + kPrime4;
+}
+
+}  // namespace
+
+uint64_t HashBytes(const uint8_t *data, size_t size, uint64_t seed) {
+    const uint8_t *end = data + size;
+    uint64_t hash;
+    if (size >= 32) {
+        uint64_t acc[4] = {seed + kPrime1 + kPrime2, seed + kPrime2, seed, seed - kPrime1};
+        for (; end - data >= 32; data += 32) {
+            for (int lane = 0; lane < 4; ++lane) {
+                acc[lane] = Round(acc[lane], Load64(data + 8 * lane));
+            }
+        }
+        hash = RotateLeft(acc[0], 1) + RotateLeft(acc[1], 7) + RotateLeft(acc[2], 12) +
+               RotateLeft(acc[3], 18);
+        for (auto lane : acc) {
+            hash = MergeRound(hash, lane);
+        }
+    } else {
+        hash = seed + kPrime5;
+    }
+    hash += size;
+
+    for (; end - data >= 8; data += 8) {
+        hash ^= Round(0, Load64(data));
+        hash = RotateLeft(hash, 27) * kPrime1 + kPrime4;
+    }
+    if (end - data >= 4) {
+        hash ^= Load32(data) * kPrime1;
+        hash = RotateLeft(hash, 23) * kPrime2 + kPrime3;
+        data += 4;
+    }
+    for (; data < end; ++data) {
+        hash ^= *data * kPrime5;
+        hash = RotateLeft(hash, 11) * kPrime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    hash *= kPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
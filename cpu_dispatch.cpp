@@ -0,0 +1,81 @@
+#include <cpu_dispatch.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+const CpuLevel kAllLevels[] = {CpuLevel::kScalar, CpuLevel::kSse42, CpuLevel::kAvx2,
+                               CpuLevel::kAvx512};
+
+CpuLevel LevelFromEnv(CpuLevel detected) {
+    const char *name = std::getenv("JPEG_DECODER_CPU_LEVEL");
+    if (name == nullptr) {
+        return detected;
+    }
+    for (auto level : kAllLevels) {
+        if (name == std::string(CpuLevelName(level)) && level <= detected) {
+            return level;
+        }
+    }
+    return detected;
+}
+
+std::atomic<int> &CurrentLevel() {
+    static std::atomic<int> level(static_cast<int>(LevelFromEnv(DetectCpuLevel())));
+    return level;
+}
+
+}  // namespace
+
+const char *CpuLevelName(CpuLevel level) {
+    switch (level) {
+        case CpuLevel::kScalar:
+            return "scalar";
+        case CpuLevel::kSse42:
+            return "sse4.2";
+        case CpuLevel::kAvx2:
+            return "avx2";
+        case CpuLevel::kAvx512:
+            return "avx512";
+    }
+    return "unknown";
+}
+
+CpuLevel DetectCpuLevel() {
+    static const CpuLevel kDetected = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        if (avx2 && __builtin_cpu_supports("avx512f")) {
+            return CpuLevel::kAvx512;
+        }
+        if (avx2) {
+            return CpuLevel::kAvx2;
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+            return CpuLevel::kSse42;
+        }
+#endif
+        return CpuLevel::kScalar;
+    }();
+    return kDetected;
+}
+
+CpuLevel GetCpuLevel() {
+    return static_cast<CpuLevel>(CurrentLevel().load(std::memory_order_relaxed));
+}
+
+void ForceCpuLevel(CpuLevel level) {
+    if (level > DetectCpuLevel()) {
+        throw std::invalid_argument(std::string("CPU level is not supported: ") +
+                                    CpuLevelName(level));
+    }
+    CurrentLevel().store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+const DecoderKernels &GetKernels() {
+    return GetKernels(GetCpuLevel());
+}
@@ -0,0 +1,156 @@
+#include <dc_image.h>
+
+#include <algorithm>
+#include <bitset>
+#include <cmath>
+
+namespace {
+
+double BlockMean(const DcPlane &plane, size_t y, size_t x) {
+    return plane.At(y, x) / 8. + 128.;
+}
+
+int ClampSample(double val) {
+    return static_cast<int>(std::lround(std::min(255., std::max(0., val))));
+}
+
+// Luma reduced to size x size cells, each the mean of the blocks it covers.
+// Planes smaller than that repeat their blocks.
+std::vector<double> ResampleLuma(const DcPlane &plane, size_t size) {
+    std::vector<double> cells(size * size);
+    for (size_t row = 0; row < size; ++row) {
+        size_t y_begin = row * plane.height / size;
+        size_t y_end = std::max(y_begin + 1, (row + 1) * plane.height / size);
+        for (size_t col = 0; col < size; ++col) {
+            size_t x_begin = col * plane.width / size;
+            size_t x_end = std::max(x_begin + 1, (col + 1) * plane.width / size);
+            double sum = 0;
+            for (size_t y = y_begin; y < y_end; ++y) {
+                for (size_t x = x_begin; x < x_end; ++x) {
+                    sum += BlockMean(plane, y, x);
+                }
+            }
+            cells[row * size + col] = sum / ((y_end - y_begin) * (x_end - x_begin));
+        }
+    }
+    return cells;
+}
+
+bool HasLuma(const DcImage &image) {
+    return image.Ok() && !image.planes.empty() && !image.planes[0].values.empty();
+}
+
+}  // namespace
+
+RGB DcBlockColour(const DcImage &image, size_t y, size_t x) {
+    double luma = BlockMean(image.planes[0], y, x);
+    if (image.planes.size() < 3) {
+        int val = ClampSample(luma);
+        return {val, val, val};
+    }
+    const auto &cb_plane = image.planes[1];
+    size_t cy = y * 8 / cb_plane.block_height;
+    size_t cx = x * 8 / cb_plane.block_width;
+    double cb = BlockMean(cb_plane, cy, cx) - 128.;
+    double cr = BlockMean(image.planes[2], cy, cx) - 128.;
+    return {ClampSample(luma + 1.402 * cr), ClampSample(luma - 0.344136 * cb - 0.714136 * cr),
+            ClampSample(luma + 1.772 * cb)};
+}
+
+RGB DcAverageColour(const DcImage &image) {
+    if (!HasLuma(image)) {
+        return {0, 0, 0};
+    }
+    const auto &luma = image.planes[0];
+    double sum[3] = {0, 0, 0};
+    for (size_t y = 0; y < luma.height; ++y) {
+        for (size_t x = 0; x < luma.width; ++x) {
+            RGB colour = DcBlockColour(image, y, x);
+            sum[0] += colour.r;
+            sum[1] += colour.g;
+            sum[2] += colour.b;
+        }
+    }
+    double count = luma.values.size();
+    return {ClampSample(sum[0] / count), ClampSample(sum[1] / count),
+            ClampSample(sum[2] / count)};
+}
+
+std::array<std::array<uint32_t, kDcHistogramBins>, 3> DcColourHistogram(const DcImage &image) {
+    std::array<std::array<uint32_t, kDcHistogramBins>, 3> histogram{};
+    if (!HasLuma(image)) {
+        return histogram;
+    }
+    const auto &luma = image.planes[0];
+    for (size_t y = 0; y < luma.height; ++y) {
+        for (size_t x = 0; x < luma.width; ++x) {
+            RGB colour = DcBlockColour(image, y, x);
+            ++histogram[0][colour.r * kDcHistogramBins / 256];
+            ++histogram[1][colour.g * kDcHistogramBins / 256];
+            ++histogram[2][colour.b * kDcHistogramBins / 256];
+        }
+    }
+    return histogram;
+}
+
+uint64_t DcAverageHash(const DcImage &image) {
+    if (!HasLuma(image)) {
+        return 0;
+    }
+    auto cells = ResampleLuma(image.planes[0], 8);
+    double mean = 0;
+    for (double cell : cells) {
+        mean += cell / cells.size();
+    }
+    uint64_t hash = 0;
+    for (size_t id = 0; id < 64; ++id) {
+        hash |= static_cast<uint64_t>(cells[id] > mean) << id;
+    }
+    return hash;
+}
+
+uint64_t DcDctHash(const DcImage &image) {
+    if (!HasLuma(image)) {
+        return 0;
+    }
+    const size_t size = 32;
+    auto cells = ResampleLuma(image.planes[0], size);
+    double cosines[8][size];
+    for (size_t freq = 0; freq < 8; ++freq) {
+        for (size_t pos = 0; pos < size; ++pos) {
+            cosines[freq][pos] = std::cos((2 * pos + 1) * freq * M_PI / (2 * size));
+        }
+    }
+    // Only the lowest frequencies are needed, rows first, then columns.
+    double rows[size][8];
+    for (size_t y = 0; y < size; ++y) {
+        for (size_t u = 0; u < 8; ++u) {
+            rows[y][u] = 0;
+            for (size_t x = 0; x < size; ++x) {
+                rows[y][u] += cells[y * size + x] * cosines[u][x];
+            }
+        }
+    }
+    double coefs[64];
+    for (size_t v = 0; v < 8; ++v) {
+        for (size_t u = 0; u < 8; ++u) {
+            coefs[v * 8 + u] = 0;
+            for (size_t y = 0; y < size; ++y) {
+                coefs[v * 8 + u] += rows[y][u] * cosines[v][y];
+            }
+        }
+    }
+    double sorted[64];
+    std::copy(coefs, coefs + 64, sorted);
+    std::nth_element(sorted, sorted + 32, sorted + 64);
+    double median = sorted[32];
+    uint64_t hash = 0;
+    for (size_t id = 0; id < 64; ++id) {
+        hash |= static_cast<uint64_t>(coefs[id] > median) << id;
+    }
+    return hash;
+}
+
+int HashDistance(uint64_t lhs, uint64_t rhs) {
+    return std::bitset<64>(lhs ^ rhs).count();
+}
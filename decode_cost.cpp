@@ -0,0 +1,169 @@
+#include <decode_cost.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "jpeg_encoder.h"
+#include "scan_decoder.h"
+
+namespace {
+
+const size_t kFeatures = 4;
+
+struct FrameSize {
+    size_t pixels;
+    size_t blocks;
+};
+
+FrameSize MeasureFrame(const FrameInfo &frame) {
+    bool gray = frame.components == 1;
+    size_t mcu_width = 8 * (gray ? 1 : frame.hor_sampling);
+    size_t mcu_height = 8 * (gray ? 1 : frame.vert_sampling);
+    size_t blocks_per_mcu = gray ? 1 : frame.hor_sampling * frame.vert_sampling + 2;
+    size_t mcus = (frame.width + mcu_width - 1) / mcu_width *
+                  ((frame.height + mcu_height - 1) / mcu_height);
+    return {frame.width * frame.height, mcus * blocks_per_mcu};
+}
+
+std::vector<double> Features(const FrameInfo &frame) {
+    auto size = MeasureFrame(frame);
+    return {1., static_cast<double>(size.pixels), static_cast<double>(size.blocks),
+            static_cast<double>(frame.file_size)};
+}
+
+double TimeDecode(const std::string &data) {
+    double best = 0;
+    for (int run = 0; run < 3; ++run) {
+        std::istringstream input(data);
+        auto start = std::chrono::steady_clock::now();
+        auto result = TryDecode(input);
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = run == 0 ? seconds : std::min(best, seconds);
+    }
+    return best;
+}
+
+// Least squares by normal equations, columns are scaled to [0, 1] first so
+// that pixel counts and the constant term stay comparable.
+std::vector<double> FitLinear(const std::vector<std::vector<double>> &rows,
+                              const std::vector<double> &values) {
+    std::vector<double> scale(kFeatures, 0);
+    for (const auto &row : rows) {
+        for (size_t col = 0; col < kFeatures; ++col) {
+            scale[col] = std::max(scale[col], row[col]);
+        }
+    }
+    double normal[kFeatures][kFeatures + 1] = {};
+    for (size_t id = 0; id < rows.size(); ++id) {
+        for (size_t lhs = 0; lhs < kFeatures; ++lhs) {
+            double lhs_val = rows[id][lhs] / scale[lhs];
+            for (size_t rhs = 0; rhs < kFeatures; ++rhs) {
+                normal[lhs][rhs] += lhs_val * rows[id][rhs] / scale[rhs];
+            }
+            normal[lhs][kFeatures] += lhs_val * values[id];
+        }
+    }
+    for (size_t col = 0; col < kFeatures; ++col) {
+        size_t pivot = col;
+        for (size_t row = col + 1; row < kFeatures; ++row) {
+            if (std::abs(normal[row][col]) > std::abs(normal[pivot][col])) {
+                pivot = row;
+            }
+        }
+        std::swap(normal[col], normal[pivot]);
+        if (std::abs(normal[col][col]) < 1e-12) {
+            continue;
+        }
+        for (size_t row = 0; row < kFeatures; ++row) {
+            if (row == col) {
+                continue;
+            }
+            double factor = normal[row][col] / normal[col][col];
+            for (size_t pos = col; pos <= kFeatures; ++pos) {
+                normal[row][pos] -= factor * normal[col][pos];
+            }
+        }
+    }
+    std::vector<double> coefs(kFeatures, 0);
+    for (size_t col = 0; col < kFeatures; ++col) {
+        if (std::abs(normal[col][col]) >= 1e-12) {
+            coefs[col] = normal[col][kFeatures] / normal[col][col] / scale[col];
+        }
+    }
+    return coefs;
+}
+
+}  // namespace
+
+DecodeCost EstimateDecodeCost(const FrameInfo &frame, const DecodeCostModel &model) {
+    DecodeCost cost;
+    cost.supported = frame.supported;
+    if (!frame.supported) {
+        return cost;
+    }
+    auto size = MeasureFrame(frame);
+    // The scan is copied into a growing vector, coefficients of the whole
+    // image are kept until reconstruction, which writes into the image.
+    size_t peak = 2 * frame.file_size + size.blocks * sizeof(CoefBlock) +
+                  frame.height * (sizeof(std::vector<RGB>) + frame.width * sizeof(RGB));
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunks = std::min(threads, frame.file_size / kMinChunkBytes);
+    if (frame.restart_interval == 0 && chunks > 1) {
+        // Speculative runs hold their blocks with start positions and slots
+        // in growing vectors, all chunks but the first one.
+        peak += 2 * size.blocks * (sizeof(CoefBlock) + 2 * sizeof(size_t)) * (chunks - 1) /
+                chunks;
+    }
+    cost.peak_bytes = peak;
+    cost.seconds = model.fixed_seconds + model.per_pixel * size.pixels +
+                   model.per_block * size.blocks + model.per_byte * frame.file_size;
+    return cost;
+}
+
+DecodeCostModel CalibrateDecodeCost(size_t pixels) {
+    std::vector<std::vector<double>> rows;
+    std::vector<double> values;
+    uint64_t seed = 0;
+    for (size_t frame_pixels : {std::max<size_t>(pixels / 4, 64), std::max<size_t>(pixels, 256)}) {
+        for (auto subsampling :
+             {Subsampling::kGray, Subsampling::k444, Subsampling::k422, Subsampling::k420}) {
+            for (int quality : {50, 95}) {
+                EncoderOptions options;
+                options.width = std::min<size_t>(65535, std::sqrt(frame_pixels * 4 / 3));
+                options.height = std::max<size_t>(1, frame_pixels / options.width);
+                options.subsampling = subsampling;
+                options.quality = quality;
+                std::ostringstream output;
+                EncodeJpeg(options,
+                           MakeSyntheticSource(options.width, subsampling == Subsampling::kGray,
+                                               ++seed),
+                           output);
+                std::string data = output.str();
+
+                FrameInfo frame;
+                std::istringstream header(data);
+                if (ReadFrameInfo(header, data.size(), frame) != DecodeStatus::kOk) {
+                    continue;
+                }
+                rows.push_back(Features(frame));
+                values.push_back(TimeDecode(data));
+            }
+        }
+    }
+    auto coefs = FitLinear(rows, values);
+    // Timing noise can push a term below zero, no part of the decode is free.
+    for (auto &coef : coefs) {
+        coef = std::max(0., coef);
+    }
+    DecodeCostModel model;
+    model.fixed_seconds = coefs[0];
+    model.per_pixel = coefs[1];
+    model.per_block = coefs[2];
+    model.per_byte = coefs[3];
+    return model;
+}
@@ -1,251 +1,733 @@
 #include <decoder.h>
+#include <content_hash.h>
+#include <cpu_dispatch.h>
+#include <dc_image.h>
+#include <decode_cost.h>
+#include <gray_image.h>
+#include <decode_result.h>
+#include <mcu_index.h>
+#include <validate.h>
 #include <glog/logging.h>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdint>
 #include <exception>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <new>
 #include <optional>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <unordered_map>
 #include "bitreader.h"
+#include "frame_decoder.h"
 #include "markers.h"
 #include "structures.h"
 #include "marker_readers.h"
 #include "image.h"
-#include "huffman.h"
+#include "scan_decoder.h"
 #include "fft.h"
 #include "util_funcs.h"
 
-std::optional<std::pair<int, int>> GetValueInTable(BitReader &reader, HuffTabParametrs &tab,
-                                                   bool is_dc) {
-    while (true) {
-        int value;
-        bool ok = tab.huffman.Move(reader.GetBit(), value);
-        if (ok) {
-            if (value == 0 && !is_dc) {
-                return std::nullopt;
-            } else if (value == 0 && is_dc) {
-                return std::pair<int, int>{0, 0};
-            }
-            int cnt_zeros = value >> 4;
-            int ans = 0;
-            bool neg = false;
-            for (size_t id = 0; id < (value & 15); ++id) {
-                ans <<= 1;
-                ans ^= (reader.GetBit()) ^ neg;
-                if (id == 0 && ans == 0) {
-                    neg = true;
-                    ans = 1;
-                }
-            }
-            if (neg) {
-                ans *= -1;
-            }
-            return std::pair<int, int>{cnt_zeros, ans};
-        }
+const char *DecodeStatusMessage(DecodeStatus status) {
+    switch (status) {
+        case DecodeStatus::kOk:
+            return "Ok";
+        case DecodeStatus::kTruncated:
+            return "Bad jpeg, unexpected EOF";
+        case DecodeStatus::kBadMarker:
+            return "Bad jpeg, bad marker";
+        case DecodeStatus::kBadFrame:
+            return "Bad parametrs in SOF0";
+        case DecodeStatus::kBadHuffmanTable:
+            return "Bad huffman table";
+        case DecodeStatus::kBadQuantTable:
+            return "Bad quant table";
+        case DecodeStatus::kBadScanHeader:
+            return "Bad parametrs in SOS";
+        case DecodeStatus::kBadRestart:
+            return "Bad restart interval";
+        case DecodeStatus::kBadScanData:
+            return "Bad block in scan";
+        case DecodeStatus::kUnsupported:
+            return "Not supported jpeg type";
+        case DecodeStatus::kOutOfMemory:
+            return "Out of memory";
+        case DecodeStatus::kIoError:
+            return "IO error";
+        case DecodeStatus::kCancelled:
+            return "Decode cancelled";
+        case DecodeStatus::kDeadlineExceeded:
+            return "Decode deadline exceeded";
+        case DecodeStatus::kLimitExceeded:
+            return "Decode limit exceeded";
     }
+    return "Unknown status";
 }
 
-Matrix88 ExtractTable(BitReader &reader, HuffTabParametrs &dc_huff, HuffTabParametrs &ac_huff) {
-    std::vector<int> seq;
-    seq.reserve(64);
-    for (bool is_first = true; seq.size() < 64; is_first = false) {
-        auto pr = GetValueInTable(reader, is_first ? dc_huff : ac_huff, is_first);
-        if (!pr.has_value()) {
-            FillWithCnt(seq, {-1, -1});
-            break;
-        } else {
-            FillWithCnt(seq, pr.value());
+void ThrowIfFailed(DecodeStatus status) {
+    if (status != DecodeStatus::kOk) {
+        throw std::runtime_error(DecodeStatusMessage(status));
+    }
+}
+
+// Returns null if there is no such table.
+const HuffmanLookup *FindHuffmanTable(const std::vector<HuffTabParametrs> &huffman_tables,
+                                      size_t table_class, size_t table_id) {
+    for (auto it = huffman_tables.rbegin(); it != huffman_tables.rend(); ++it) {
+        if (it->table_class == table_class && it->table_id == table_id) {
+            return it->huffman;
         }
     }
-    if (seq.size() > 64) {
-        throw std::runtime_error("Size of matrix exceeded 64 in ExtractTable");
+    return nullptr;
+}
+
+const Matrix88 *FindQuantTable(const std::vector<QuantTable> &quant_tables, size_t table_dest) {
+    for (auto it = quant_tables.rbegin(); it != quant_tables.rend(); ++it) {
+        if (it->table_dest == table_dest) {
+            return &it->table;
+        }
     }
-    return ZigZagConvert(seq);
+    return nullptr;
 }
 
-void ReadEncodedData(BitReader &reader,
-                     const std::unordered_map<size_t, FrameParametrs> &frames_pars,
-                     const std::vector<QuantTable> &quant_tables,
-                     std::vector<HuffTabParametrs> &huffman_tables, Image &image) {
-    if (image.Height() == 0 || image.Width() == 0) {
-        throw std::runtime_error("Empty jpeg");
+DecodeStatus MakeFrameLayout(const JpegHeader &header, FrameLayout &layout) {
+    if (header.height == 0 || header.width == 0) {
+        return DecodeStatus::kBadFrame;
+    }
+    if (!(header.frames_pars.size() == 1 || header.frames_pars.size() == 3)) {
+        return DecodeStatus::kUnsupported;
     }
 
-    size_t hor_sampling = frames_pars.at(1).hor_sampling;
-    size_t vert_sampling = frames_pars.at(1).vert_sampling;
-    if (!(hor_sampling >= 1 && hor_sampling <= 2 && vert_sampling >= 1 && vert_sampling <= 2)) {
-        throw std::runtime_error("Bad sampling in ReadEncodedData");
+    for (const auto &[label, pars] : header.frames_pars) {
+        layout.comps.push_back(pars);
     }
-    if (!(frames_pars.size() == 1 || frames_pars.size() == 3)) {
-        throw std::runtime_error("Bad frames count in ReadEncodedData");
+    auto &comps = layout.comps;
+    std::sort(comps.begin(), comps.end(),
+              [](const auto &lhs, const auto &rhs) { return lhs.label < rhs.label; });
+
+    // A single component scan is not interleaved, its MCU is always one block.
+    layout.hor_sampling = comps.size() == 1 ? 1 : comps[0].hor_sampling;
+    layout.vert_sampling = comps.size() == 1 ? 1 : comps[0].vert_sampling;
+    if (!(layout.hor_sampling >= 1 && layout.hor_sampling <= 2 && layout.vert_sampling >= 1 &&
+          layout.vert_sampling <= 2)) {
+        return DecodeStatus::kUnsupported;
     }
-    if (!(huffman_tables.size() == 4 || huffman_tables.size() == 2)) {
-        throw std::runtime_error("Bad huffman_tables count in ReadEncodedData");
+    if (comps.size() == 3) {
+        for (size_t comp = 1; comp < 3; ++comp) {
+            if (comps[comp].hor_sampling != 1 || comps[comp].vert_sampling != 1) {
+                return DecodeStatus::kUnsupported;
+            }
+        }
     }
 
-    if (frames_pars.size() == 3) {
-        if (frames_pars.at(2).hor_sampling != 1 || frames_pars.at(2).vert_sampling != 1) {
-            throw std::runtime_error("Bad sampling in Cb in ReadEncodedData");
+    layout.mcu_height = 8 * layout.vert_sampling;
+    layout.mcu_width = 8 * layout.hor_sampling;
+    layout.mcu_tab_width = (header.width + layout.mcu_width - 1) / layout.mcu_width;
+
+    auto &scan = layout.scan;
+    scan.slot_component.assign(layout.hor_sampling * layout.vert_sampling, 0);
+    for (size_t comp = 0; comp < comps.size(); ++comp) {
+        if (comp != 0) {
+            scan.slot_component.push_back(comp);
+        }
+        const auto *dc = FindHuffmanTable(header.huffman_tables, 0, comps[comp].dc_huff_dest);
+        const auto *ac = FindHuffmanTable(header.huffman_tables, 1, comps[comp].ac_huff_dest);
+        if (dc == nullptr || ac == nullptr) {
+            return DecodeStatus::kBadHuffmanTable;
+        }
+        scan.dc_tables.push_back(dc);
+        scan.ac_tables.push_back(ac);
+        const auto *table = FindQuantTable(header.quant_tables, comps[comp].qtable_dest);
+        if (table == nullptr) {
+            return DecodeStatus::kBadQuantTable;
         }
-        if (frames_pars.at(3).hor_sampling != 1 || frames_pars.at(3).vert_sampling != 1) {
-            throw std::runtime_error("Bad sampling in Cr in ReadEncodedData");
+        scan.quant.emplace_back();
+        for (size_t id = 0; id < 64; ++id) {
+            scan.quant.back()[id] = table->Get(kZigZagOrder[id] / 8, kZigZagOrder[id] % 8);
         }
     }
+    scan.mcu_count =
+        layout.mcu_tab_width * ((header.height + layout.mcu_height - 1) / layout.mcu_height);
+    scan.mcus_per_row = layout.mcu_tab_width;
+    scan.restart_interval = header.restart_interval;
+    return DecodeStatus::kOk;
+}
 
-    std::vector<MCUBlock> image_blocks;
-
-    size_t dc_y_pos;
-    size_t ac_y_pos;
-    size_t dc_ch_pos;
-    size_t ac_ch_pos;
-    for (size_t id = 0; id < huffman_tables.size(); ++id) {
-        if (huffman_tables[id].table_id == 0) {
-            if (huffman_tables[id].table_class == 0) {
-                dc_y_pos = id;
-            } else {
-                ac_y_pos = id;
-            }
-        } else {
-            if (huffman_tables[id].table_class == 0) {
-                dc_ch_pos = id;
-            } else {
-                ac_ch_pos = id;
-            }
+// |info.progressive| must already be set.
+void FillFrameInfo(const JpegHeader &header, FrameInfo &info) {
+    std::vector<FrameParametrs> comps;
+    for (const auto &[label, pars] : header.frames_pars) {
+        comps.push_back(pars);
+    }
+    std::sort(comps.begin(), comps.end(),
+              [](const auto &lhs, const auto &rhs) { return lhs.label < rhs.label; });
+    info.width = header.width;
+    info.height = header.height;
+    info.components = comps.size();
+    info.restart_interval = header.restart_interval;
+    if (comps.size() == 3) {
+        info.hor_sampling = comps[0].hor_sampling;
+        info.vert_sampling = comps[0].vert_sampling;
+    }
+    // Mirrors the checks of MakeFrameLayout.
+    info.supported = !info.progressive && info.width != 0 && info.height != 0 &&
+                     (comps.size() == 1 || comps.size() == 3) && info.hor_sampling <= 2 &&
+                     info.vert_sampling <= 2;
+    for (size_t comp = 1; comp < comps.size(); ++comp) {
+        if (comps[comp].hor_sampling != 1 || comps[comp].vert_sampling != 1) {
+            info.supported = false;
         }
     }
+}
 
-    int pref_sum_dc = 0;
-    int pref_sum_dc_sec[2] = {0, 0};
-    std::vector<double> input(64);
-    std::vector<double> output(64);
-    DctCalculator dct_calc(8, &input, &output);
-
-    do {
-        MCUBlock block;
-        for (size_t iter = 0; iter < hor_sampling * vert_sampling; ++iter) {
-            auto mat = ExtractTable(reader, huffman_tables[dc_y_pos], huffman_tables[ac_y_pos]);
-            pref_sum_dc += mat.Get(0, 0);
-            mat.Get(0, 0) = pref_sum_dc;
-            MultiplyMatrixByElements(mat, quant_tables[0].table);
-            block.y_table.push_back(mat);
-            ConvertMatrix(block.y_table.back(), dct_calc, &input, &output);
-        }
-        for (size_t iter = 0; iter < 2 && frames_pars.size() == 3; ++iter) {
-            auto mat = ExtractTable(reader, huffman_tables[dc_ch_pos], huffman_tables[ac_ch_pos]);
-            pref_sum_dc_sec[iter] += mat.Get(0, 0);
-            mat.Get(0, 0) = pref_sum_dc_sec[iter];
-            MultiplyMatrixByElements(mat, quant_tables[1].table);
-            if (iter == 0) {
-                block.cb_table = mat;
-                ConvertMatrix(block.cb_table, dct_calc, &input, &output);
-            } else {
-                block.cr_table = mat;
-                ConvertMatrix(block.cr_table, dct_calc, &input, &output);
-            }
+// Limits that can be checked before the allocations they guard. The scan
+// buffer is only counted once |scan_size| is known.
+DecodeStatus CheckLimits(const JpegHeader &header, size_t scan_size,
+                         const DecodeControl &control) {
+    auto status = control.Check();
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    if (control.max_pixels != 0 &&
+        static_cast<size_t>(header.width) * header.height > control.max_pixels) {
+        return DecodeStatus::kLimitExceeded;
+    }
+    if (control.max_memory_bytes != 0) {
+        FrameInfo frame;
+        frame.file_size = scan_size;
+        FillFrameInfo(header, frame);
+        auto cost = EstimateDecodeCost(frame, DecodeCostModel());
+        if (cost.peak_bytes > control.max_memory_bytes) {
+            return DecodeStatus::kLimitExceeded;
         }
-        image_blocks.push_back(std::move(block));
-    } while (!reader.CheckEndOfJpeg());
+    }
+    return DecodeStatus::kOk;
+}
 
-    size_t mcu_height = 8 * vert_sampling;
-    size_t mcu_width = 8 * hor_sampling;
+// |control| is checked once the scan size is known and then per MCU row,
+// null for none. |threads| is 0 for one per core.
+DecodeStatus DecodeCoefficients(BitReader &reader, const JpegHeader &header, bool luma_only,
+                                size_t threads, const DecodeControl *control,
+                                FrameLayout &layout, ScanCoefficients &scan) {
+    ScanData scan_data;
+    auto status = MakeFrameLayout(header, layout);
+    layout.scan.luma_only = luma_only;
+    if (status == DecodeStatus::kOk) {
+        status = ReadScanData(reader, scan_data);
+    }
+    if (status == DecodeStatus::kOk && control != nullptr) {
+        status = CheckLimits(header, scan_data.bytes.size(), *control);
+    }
+    if (status == DecodeStatus::kOk) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        status = DecodeScan(scan_data, layout.scan, threads, scan, control);
+    }
+    return status;
+}
 
-    size_t mcu_tab_width = (image.Width() + mcu_width - 1) / mcu_width;
+DecodeStatus ReadEncodedData(BitReader &reader, const JpegHeader &header,
+                             const DecodeControl &control, Image &image) {
+    FrameLayout layout;
+    ScanCoefficients scan;
+    auto status = DecodeCoefficients(reader, header, false, 0, &control, layout, scan);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
 
-    for (size_t y = 0; y < image.Height(); ++y) {
-        for (size_t x = 0; x < image.Width(); ++x) {
-            if (mcu_tab_width * (y / mcu_height) + x / mcu_width >= image_blocks.size()) {
-                break;
+    size_t blocks_per_mcu = layout.scan.slot_component.size();
+    McuWriter writer(layout, image.Height(), image.Width(), GetKernels());
+    for (size_t mcu = 0; mcu < layout.scan.mcu_count; ++mcu) {
+        if (mcu % layout.mcu_tab_width == 0) {
+            status = control.Check();
+            if (status != DecodeStatus::kOk) {
+                return status;
             }
-            const auto &mcu = image_blocks[mcu_tab_width * (y / mcu_height) + x / mcu_width];
-            size_t pos_in_y_table = y % mcu_height / 8 * 2 + x % mcu_width / 8;
-            if ((vert_sampling == 2) ^ (hor_sampling == 2)) {
-                pos_in_y_table = y % mcu_height / 8 + x % mcu_width / 8;
+        }
+        writer.Put(mcu, scan.blocks.data() + blocks_per_mcu * mcu, image, 0, 0);
+    }
+    return DecodeStatus::kOk;
+}
+
+void PutLumaBlocks(const FrameLayout &layout, const ScanCoefficients &scan,
+                   const DecoderKernels &kernels, GrayImage &image) {
+    size_t blocks_per_mcu = layout.scan.slot_component.size();
+    alignas(64) float block[64];
+    for (size_t mcu = 0; mcu < layout.scan.mcu_count; ++mcu) {
+        size_t mcu_y = mcu / layout.mcu_tab_width * layout.mcu_height;
+        size_t mcu_x = mcu % layout.mcu_tab_width * layout.mcu_width;
+        for (size_t slot = 0; slot < layout.hor_sampling * layout.vert_sampling; ++slot) {
+            size_t block_y = mcu_y + slot / layout.hor_sampling * 8;
+            size_t block_x = mcu_x + slot % layout.hor_sampling * 8;
+            if (block_y >= image.height || block_x >= image.width) {
+                continue;
             }
-            double y_val = mcu.y_table[pos_in_y_table].Get(y % 8, x % 8);
-            size_t pos_y = (y % mcu_height) / vert_sampling;
-            size_t pos_x = (x % mcu_width) / hor_sampling;
-            RGB pix;
-            if (frames_pars.size() == 3) {
-                pix = ConvertYCbCrToRGB(
-                    YCbCr{y_val, mcu.cb_table.Get(pos_y, pos_x), mcu.cr_table.Get(pos_y, pos_x)});
-            } else {
-                pix = ConvertYCbCrToRGB(YCbCr{y_val, 128, 128});
+            kernels.idct(scan.blocks[mcu * blocks_per_mcu + slot].coef, block);
+            size_t y_end = std::min(image.height, block_y + 8);
+            size_t x_end = std::min(image.width, block_x + 8);
+            for (size_t y = block_y; y < y_end; ++y) {
+                const float *src = block + (y - block_y) * 8;
+                uint8_t *dst = image.pixels.data() + y * image.width;
+                for (size_t x = block_x; x < x_end; ++x) {
+                    dst[x] = static_cast<uint8_t>(src[x - block_x]);
+                }
             }
-            image.SetPixel(y, x, pix);
         }
     }
 }
 
-Image Decode(std::istream &input) {
-    std::unordered_map<size_t, FrameParametrs> frames_pars;
-    std::vector<QuantTable> quant_tables;
-    std::vector<HuffTabParametrs> huffman_tables;
-    Image result;
-    BitReader reader(input);
+// Reconstructs the Y blocks only, the chroma ones were just skipped.
+DecodeStatus ReadLumaData(BitReader &reader, const JpegHeader &header, GrayImage &image) {
+    FrameLayout layout;
+    ScanCoefficients scan;
+    auto status = DecodeCoefficients(reader, header, true, 0, nullptr, layout, scan);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
 
-    {
-        auto marker = IdentMarker(reader.GetDoubleByte());
-        if (marker != JpegMarkers::SOI) {
-            throw std::runtime_error("Bad jpeg, no SOI at start");
-        }
+    PutLumaBlocks(layout, scan, GetKernels(), image);
+    return DecodeStatus::kOk;
+}
+
+// What ReadHeader accepts besides a baseline frame.
+enum class HeaderMode {
+    kBaseline,
+    // Also takes SOF2 and stops at SOS without reading the scan header, whose
+    // progressive fields ReadSOS rejects. For callers that need only the frame.
+    kFrame,
+};
+
+DecodeStatus ReadMarkerSegment(BitReader &reader, JpegMarkers marker, HeaderMode mode,
+                               bool &was_sof, JpegHeader &header) {
+    switch (marker) {
+        case JpegMarkers::SOF2:
+            if (mode != HeaderMode::kFrame) {
+                return DecodeStatus::kUnsupported;
+            }
+            header.progressive = true;
+            [[fallthrough]];
+        case JpegMarkers::SOF0:
+            // Both frame headers have the same syntax.
+            if (was_sof) {
+                return DecodeStatus::kBadFrame;
+            }
+            was_sof = true;
+            return ReadSOF0(reader, header);
+        case JpegMarkers::DHT:
+            return ReadDHT(reader, header);
+        case JpegMarkers::DQT:
+            return ReadDQT(reader, header.quant_tables);
+        case JpegMarkers::DRI:
+            return ReadDRI(reader, header.restart_interval);
+        case JpegMarkers::APPn:
+            return ReadAPPn(reader);
+        case JpegMarkers::COM:
+            return ReadCOM(reader, header.comment);
+        default:
+            // SOI, RSTn and unknown markers can't appear between segments.
+            return DecodeStatus::kBadMarker;
+    }
+}
+
+// Reads markers up to the first scan. |has_scan| is false if EOI comes first.
+DecodeStatus ReadHeader(BitReader &reader, std::istream &input, JpegHeader &header,
+                        bool &has_scan, HeaderMode mode = HeaderMode::kBaseline) {
+    if (IdentMarker(reader.GetDoubleByte()) != JpegMarkers::SOI) {
+        return reader.Failed() ? DecodeStatus::kTruncated : DecodeStatus::kBadMarker;
     }
 
-    bool was_sof0 = false;
+    bool was_sof = false;
     while (true) {
-        uint16_t bts = reader.GetDoubleByte();
-        auto marker = IdentMarker(bts);
-        if (marker == JpegMarkers::NOTAMARKER) {
-            throw std::runtime_error("Bad jpeg, unknown marker");
-        }
-        if (marker == JpegMarkers::SOI) {
-            throw std::runtime_error("Bad jpeg, second SOI");
+        auto marker = IdentMarker(reader.GetDoubleByte());
+        if (reader.Failed()) {
+            return DecodeStatus::kTruncated;
         }
-        if (marker == JpegMarkers::SOF0) {
-            if (was_sof0) {
-                throw std::runtime_error("Second SOF0");
-            }
-            was_sof0 = true;
-            uint16_t height;
-            uint16_t width;
-            frames_pars = ReadSOF0(reader, height, width);
-            result.SetSize(width, height);
-        }
-        if (marker == JpegMarkers::SOF2) {
-            throw std::runtime_error("Progressive type, not implemented");
-        }
-        if (marker == JpegMarkers::DHT) {
-            for (HuffTabParametrs &tb : ReadDHT(reader)) {
-                huffman_tables.push_back(std::move(tb));
+        if (marker == JpegMarkers::SOS) {
+            has_scan = true;
+            if (mode == HeaderMode::kFrame) {
+                return DecodeStatus::kOk;
             }
+            return ReadSOS(reader, header.frames_pars);
         }
-        if (marker == JpegMarkers::DQT) {
-            for (auto tb : ReadDQT(reader)) {
-                quant_tables.push_back(tb);
-            }
+        if (marker == JpegMarkers::EOI) {
+            has_scan = false;
+            return input.eof() ? DecodeStatus::kOk : DecodeStatus::kBadMarker;
         }
-        if (marker == JpegMarkers::DRI) {
-            ReadDRI(reader);
+        auto status = ReadMarkerSegment(reader, marker, mode, was_sof, header);
+        if (status != DecodeStatus::kOk) {
+            return status;
         }
-        if (marker == JpegMarkers::SOS) {
-            ReadSOS(reader, frames_pars);
-            ReadEncodedData(reader, frames_pars, quant_tables, huffman_tables, result);
-            return result;
+    }
+}
+
+DecodeStatus ReadFrame(std::istream &input, FrameInfo &info) {
+    JpegHeader header;
+    BitReader reader(input);
+    bool has_scan = false;
+    auto status = ReadHeader(reader, input, header, has_scan, HeaderMode::kFrame);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    if (header.frames_pars.empty()) {
+        return DecodeStatus::kBadFrame;
+    }
+
+    info.progressive = header.progressive;
+    FillFrameInfo(header, info);
+    return DecodeStatus::kOk;
+}
+
+DecodeStatus DecodeImage(std::istream &input, const DecodeControl &control, Image &result) {
+    JpegHeader header;
+    BitReader reader(input);
+    bool has_scan = false;
+    auto status = ReadHeader(reader, input, header, has_scan);
+    if (status == DecodeStatus::kOk) {
+        status = CheckLimits(header, 0, control);
+    }
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    result.SetSize(header.width, header.height);
+    result.SetComment(header.comment);
+    return has_scan ? ReadEncodedData(reader, header, control, result) : DecodeStatus::kOk;
+}
+
+DecodeStatus DecodeLumaImage(std::istream &input, GrayImage &result) {
+    JpegHeader header;
+    BitReader reader(input);
+    bool has_scan = false;
+    auto status = ReadHeader(reader, input, header, has_scan);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    result.width = header.width;
+    result.height = header.height;
+    result.pixels.assign(result.width * result.height, 0);
+    result.comment = header.comment;
+    return has_scan ? ReadLumaData(reader, header, result) : DecodeStatus::kOk;
+}
+
+DecodeStatus ReadCoefficients(std::istream &input, size_t threads, FrameCoefficients &frame) {
+    JpegHeader header;
+    BitReader reader(input);
+    bool has_scan = false;
+    auto status = ReadHeader(reader, input, header, has_scan);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    if (!has_scan) {
+        return DecodeStatus::kBadMarker;
+    }
+    frame.width = header.width;
+    frame.height = header.height;
+    frame.comment = header.comment;
+    return DecodeCoefficients(reader, header, false, threads, nullptr, frame.layout, frame.scan);
+}
+
+DecodeResult TryDecode(std::istream &input) noexcept {
+    return TryDecode(input, DecodeControl());
+}
+
+DecodeResult TryDecode(std::istream &input, const DecodeControl &control) noexcept {
+    DecodeResult result;
+    // The core reports errors through statuses, only allocation, threads and a
+    // stream with exceptions enabled can still throw.
+    try {
+        result.status = DecodeImage(input, control, result.image);
+    } catch (const std::bad_alloc &) {
+        result.status = DecodeStatus::kOutOfMemory;
+    } catch (...) {
+        result.status = DecodeStatus::kIoError;
+    }
+    return result;
+}
+
+Image Decode(std::istream &input) {
+    auto result = TryDecode(input);
+    ThrowIfFailed(result.status);
+    return std::move(result.image);
+}
+
+DecodeStatus ReadFrameInfo(std::istream &input, size_t file_size, FrameInfo &info) noexcept {
+    info = FrameInfo();
+    info.file_size = file_size;
+    try {
+        return ReadFrame(input, info);
+    } catch (const std::bad_alloc &) {
+        return DecodeStatus::kOutOfMemory;
+    } catch (...) {
+        return DecodeStatus::kIoError;
+    }
+}
+
+GrayDecodeResult TryDecodeLuma(std::istream &input) noexcept {
+    GrayDecodeResult result;
+    try {
+        result.status = DecodeLumaImage(input, result.image);
+    } catch (const std::bad_alloc &) {
+        result.status = DecodeStatus::kOutOfMemory;
+    } catch (...) {
+        result.status = DecodeStatus::kIoError;
+    }
+    return result;
+}
+
+GrayImage DecodeLuma(std::istream &input) {
+    auto result = TryDecodeLuma(input);
+    ThrowIfFailed(result.status);
+    return std::move(result.image);
+}
+
+DecodeStatus ValidateImage(std::istream &input, ValidationReport &report) {
+    JpegHeader header;
+    BitReader reader(input);
+    bool has_scan = false;
+    auto status = ReadHeader(reader, input, header, has_scan);
+    report.error_offset = reader.GetCurPos() / 8;
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    if (!has_scan) {
+        return DecodeStatus::kBadMarker;
+    }
+    report.width = header.width;
+    report.height = header.height;
+    report.components = header.frames_pars.size();
+    report.restart_interval = header.restart_interval;
+    FrameLayout layout;
+    status = MakeFrameLayout(header, layout);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    report.mcu_count = layout.scan.mcu_count;
+
+    size_t scan_start = reader.GetCurPos() / 8;
+    size_t scan_size = 0;
+    ScanData scan;
+    auto read_status = ReadScanData(reader, scan, &scan_size);
+    if (read_status == DecodeStatus::kOk) {
+        input.ignore(std::numeric_limits<std::streamsize>::max());
+        report.trailing_bytes = reader.GetCurPos() / 8 - scan_start - scan_size + input.gcount();
+    }
+
+    // A scan cut short or broken by a bad marker is still checked up to there,
+    // so the report points at the first MCU that failed.
+    size_t bit_pos = 0;
+    status = CheckScan(scan, layout.scan, report.valid_mcus, bit_pos);
+    if (read_status != DecodeStatus::kOk) {
+        report.error_offset = report.valid_mcus < report.mcu_count
+                                  ? scan_start + ScanFileOffset(scan, bit_pos / 8)
+                                  : scan_start + scan_size;
+        return read_status;
+    }
+    report.error_offset =
+        status == DecodeStatus::kOk ? 0 : scan_start + ScanFileOffset(scan, bit_pos / 8);
+    return status;
+}
+
+ValidationReport Validate(std::istream &input) noexcept {
+    ValidationReport report;
+    try {
+        report.status = ValidateImage(input, report);
+    } catch (const std::bad_alloc &) {
+        report.status = DecodeStatus::kOutOfMemory;
+    } catch (...) {
+        report.status = DecodeStatus::kIoError;
+    }
+    return report;
+}
+
+DecodeStatus ExtractDc(std::istream &input, DcImage &result) {
+    JpegHeader header;
+    BitReader reader(input);
+    bool has_scan = false;
+    auto status = ReadHeader(reader, input, header, has_scan);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    if (!has_scan) {
+        return DecodeStatus::kBadMarker;
+    }
+    FrameLayout layout;
+    status = MakeFrameLayout(header, layout);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    ScanData scan;
+    status = ReadScanData(reader, scan);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    size_t blocks_per_mcu = layout.scan.slot_component.size();
+    std::vector<int16_t> dc(layout.scan.mcu_count * blocks_per_mcu);
+    status = DecodeDcValues(scan, layout.scan, dc.data());
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+
+    result.width = header.width;
+    result.height = header.height;
+    result.planes.resize(layout.comps.size());
+    for (size_t comp = 0; comp < layout.comps.size(); ++comp) {
+        auto &plane = result.planes[comp];
+        plane.block_width = comp == 0 ? 8 : layout.mcu_width;
+        plane.block_height = comp == 0 ? 8 : layout.mcu_height;
+        plane.width = (header.width + plane.block_width - 1) / plane.block_width;
+        plane.height = (header.height + plane.block_height - 1) / plane.block_height;
+        plane.values.resize(plane.width * plane.height);
+    }
+    size_t hor_sampling = layout.hor_sampling;
+    for (size_t mcu = 0; mcu < layout.scan.mcu_count; ++mcu) {
+        size_t mcu_row = mcu / layout.mcu_tab_width;
+        size_t mcu_col = mcu % layout.mcu_tab_width;
+        for (size_t slot = 0; slot < blocks_per_mcu; ++slot) {
+            size_t comp = layout.scan.slot_component[slot];
+            auto &plane = result.planes[comp];
+            size_t y = comp == 0 ? mcu_row * layout.vert_sampling + slot / hor_sampling : mcu_row;
+            size_t x = comp == 0 ? mcu_col * hor_sampling + slot % hor_sampling : mcu_col;
+            if (y < plane.height && x < plane.width) {
+                plane.values[y * plane.width + x] = dc[mcu * blocks_per_mcu + slot];
+            }
         }
-        if (marker == JpegMarkers::RSTn) {
-            ReadRSTn(reader);
+    }
+    return DecodeStatus::kOk;
+}
+
+DcImage ExtractDcImage(std::istream &input) noexcept {
+    DcImage result;
+    try {
+        result.status = ExtractDc(input, result);
+    } catch (const std::bad_alloc &) {
+        result.status = DecodeStatus::kOutOfMemory;
+    } catch (...) {
+        result.status = DecodeStatus::kIoError;
+    }
+    if (!result.Ok()) {
+        result.planes.clear();
+    }
+    return result;
+}
+
+McuIndex BuildMcuIndex(std::istream &file, size_t mcu_interval) {
+    if (mcu_interval == 0) {
+        throw std::invalid_argument("Zero mcu_interval in BuildMcuIndex");
+    }
+    std::string bytes{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    std::istringstream input(bytes);
+    JpegHeader header;
+    BitReader reader(input);
+    bool has_scan = false;
+    ThrowIfFailed(ReadHeader(reader, input, header, has_scan));
+    if (!has_scan) {
+        throw std::runtime_error("No scan in BuildMcuIndex");
+    }
+    FrameLayout layout;
+    ThrowIfFailed(MakeFrameLayout(header, layout));
+    size_t scan_start = reader.GetCurPos() / 8;
+    ScanData scan;
+    ThrowIfFailed(ReadScanData(reader, scan));
+    auto file_bit_pos = [&](size_t bit_pos) {
+        return 8 * (scan_start + ScanFileOffset(scan, bit_pos / 8)) + bit_pos % 8;
+    };
+
+    McuIndex index;
+    index.source_size = bytes.size();
+    index.source_hash = HashBytes(reinterpret_cast<const uint8_t *>(bytes.data()), bytes.size());
+    index.mcu_interval = mcu_interval;
+    index.mcu_count = layout.scan.mcu_count;
+    index.component_count = layout.comps.size();
+    index.scan_end = scan_start + ScanFileOffset(scan, scan.bytes.size());
+    ScanCursor cursor;
+    cursor.pref_sum_dc.resize(layout.comps.size());
+    while (cursor.mcu < layout.scan.mcu_count) {
+        McuIndexEntry entry{file_bit_pos(cursor.bit_pos), {0, 0, 0}};
+        std::copy(cursor.pref_sum_dc.begin(), cursor.pref_sum_dc.end(), entry.pref_sum_dc.begin());
+        index.entries.push_back(entry);
+        ThrowIfFailed(DecodeMcus(scan, layout.scan, cursor,
+                                 std::min<size_t>(cursor.mcu + mcu_interval, layout.scan.mcu_count),
+                                 nullptr));
+    }
+    return index;
+}
+
+Image DecodeRegion(std::istream &input, const McuIndex &index, size_t x, size_t y, size_t width,
+                   size_t height) {
+    input.seekg(0, std::ios::end);
+    if (!input || static_cast<uint64_t>(input.tellg()) != index.source_size) {
+        throw std::runtime_error("Index does not match jpeg in DecodeRegion");
+    }
+    input.seekg(0);
+    JpegHeader header;
+    BitReader reader(input);
+    bool has_scan = false;
+    ThrowIfFailed(ReadHeader(reader, input, header, has_scan));
+    if (!has_scan) {
+        throw std::runtime_error("No scan in DecodeRegion");
+    }
+    FrameLayout layout;
+    ThrowIfFailed(MakeFrameLayout(header, layout));
+    if (index.mcu_count != layout.scan.mcu_count ||
+        index.component_count != layout.comps.size() || index.mcu_interval == 0 ||
+        index.entries.size() != (index.mcu_count + index.mcu_interval - 1) / index.mcu_interval) {
+        throw std::runtime_error("Index does not match jpeg in DecodeRegion");
+    }
+    size_t y_end = std::min<size_t>(header.height, y + height);
+    size_t x_end = std::min<size_t>(header.width, x + width);
+    if (y >= y_end || x >= x_end) {
+        return Image();
+    }
+    Image result(x_end - x, y_end - y);
+    result.SetComment(header.comment);
+
+    size_t blocks_per_mcu = layout.scan.slot_component.size();
+    McuWriter writer(layout, header.height, header.width, GetKernels());
+    std::vector<uint8_t> window;
+    std::vector<CoefBlock> blocks;
+    for (size_t row = y / layout.mcu_height; row <= (y_end - 1) / layout.mcu_height; ++row) {
+        size_t first = row * layout.mcu_tab_width + x / layout.mcu_width;
+        size_t last = row * layout.mcu_tab_width + (x_end - 1) / layout.mcu_width + 1;
+        size_t entry_id = first / index.mcu_interval;
+        size_t next_id = (last - 1) / index.mcu_interval + 1;
+        const auto &entry = index.entries[entry_id];
+
+        // Two extra bytes keep a trailing 0xFF together with its stuffed zero.
+        size_t begin = entry.file_bit_pos / 8;
+        size_t end = next_id < index.entries.size() ? index.entries[next_id].file_bit_pos / 8
+                                                    : index.scan_end;
+        if (!(begin <= end && end <= index.scan_end && index.scan_end + 2 <= index.source_size)) {
+            throw std::runtime_error("Bad index entry in DecodeRegion");
         }
-        if (marker == JpegMarkers::APPn) {
-            ReadAPPn(reader);
+        window.resize(end + 2 - begin);
+        input.clear();
+        input.seekg(begin);
+        input.read(reinterpret_cast<char *>(window.data()), window.size());
+        if (static_cast<size_t>(input.gcount()) != window.size()) {
+            throw std::runtime_error("EOF in DecodeRegion");
         }
-        if (marker == JpegMarkers::COM) {
-            result.SetComment(ReadCOM(reader));
+        ScanDataCollector collector;
+        collector.Feed(window.data(), window.size());
+        if (collector.Failed()) {
+            ThrowIfFailed(DecodeStatus::kBadScanData);
         }
-        if (marker == JpegMarkers::EOI) {
-            if (!input.eof()) {
-                throw std::runtime_error("Bad jpeg, not empty tail");
-            }
-            return result;
+        auto scan = collector.Release();
+
+        ScanCursor cursor;
+        cursor.mcu = entry_id * index.mcu_interval;
+        cursor.bit_pos = entry.file_bit_pos % 8;
+        cursor.pref_sum_dc.assign(entry.pref_sum_dc.begin(),
+                                  entry.pref_sum_dc.begin() + index.component_count);
+        ThrowIfFailed(DecodeMcus(scan, layout.scan, cursor, first, nullptr));
+        blocks.resize(blocks_per_mcu * (last - first));
+        ThrowIfFailed(DecodeMcus(scan, layout.scan, cursor, last, blocks.data()));
+        for (size_t mcu = first; mcu < last; ++mcu) {
+            writer.Put(mcu, blocks.data() + blocks_per_mcu * (mcu - first), result, y, x);
         }
     }
+    return result;
 }
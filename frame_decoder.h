@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cpu_dispatch.h>
+#include <decode_result.h>
+#include <gray_image.h>
+#include <image.h>
+#include <algorithm>
+#include <cstddef>
+#include <istream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "scan_decoder.h"
+#include "structures.h"
+
+// Geometry of a baseline frame and the block structure of its scan.
+struct FrameLayout {
+    // Components sorted by label, the first one is Y.
+    std::vector<FrameParametrs> comps;
+    size_t hor_sampling;
+    size_t vert_sampling;
+    size_t mcu_height;
+    size_t mcu_width;
+    size_t mcu_tab_width;
+    ScanLayout scan;
+};
+
+// Entropy-decoded frame, the input of reconstruction.
+struct FrameCoefficients {
+    size_t width = 0;
+    size_t height = 0;
+    std::string comment;
+    FrameLayout layout;
+    ScanCoefficients scan;
+};
+
+// Reads the header and decodes the scan with |threads| workers, 0 for one per
+// core. A file without a scan gives kBadMarker.
+DecodeStatus ReadCoefficients(std::istream &input, size_t threads, FrameCoefficients &frame);
+
+// Reconstructs MCUs from coefficients and writes their pixels into a window of the frame.
+class McuWriter {
+public:
+    static const size_t kMaxMcuSize = 16;
+
+    McuWriter(const FrameLayout &layout, size_t frame_height, size_t frame_width,
+              const DecoderKernels &kernels)
+        : layout_(layout),
+          frame_height_(frame_height),
+          frame_width_(frame_width),
+          kernels_(kernels) {
+        for (auto &plane : chroma_) {
+            std::fill(std::begin(plane), std::end(plane), 128.f);
+        }
+    }
+
+    // |image| is the window of the frame with top-left corner at (origin_y, origin_x).
+    void Put(size_t mcu, const CoefBlock *blocks, Image &image, size_t origin_y,
+             size_t origin_x) {
+        size_t hor_sampling = layout_.hor_sampling;
+        size_t vert_sampling = layout_.vert_sampling;
+        size_t mcu_width = layout_.mcu_width;
+        alignas(64) float block[64];
+        for (size_t iter = 0; iter < hor_sampling * vert_sampling; ++iter, ++blocks) {
+            kernels_.idct(blocks->coef, block);
+            float *dst = luma_ + iter / hor_sampling * 8 * mcu_width + iter % hor_sampling * 8;
+            for (size_t row = 0; row < 8; ++row) {
+                std::copy(block + row * 8, block + row * 8 + 8, dst + row * mcu_width);
+            }
+        }
+        for (size_t iter = 0; iter < 2 && layout_.comps.size() == 3; ++iter, ++blocks) {
+            kernels_.idct(blocks->coef, block);
+            for (size_t row = 0; row < layout_.mcu_height; ++row) {
+                const float *src = block + row / vert_sampling * 8;
+                float *dst = chroma_[iter] + row * mcu_width;
+                if (hor_sampling == 2) {
+                    kernels_.upsample_h2(src, 8, dst);
+                } else {
+                    std::copy(src, src + 8, dst);
+                }
+            }
+        }
+
+        size_t mcu_y = mcu / layout_.mcu_tab_width * layout_.mcu_height;
+        size_t mcu_x = mcu % layout_.mcu_tab_width * mcu_width;
+        size_t y_end = std::min({frame_height_, origin_y + image.Height(),
+                                 mcu_y + layout_.mcu_height});
+        size_t x_begin = std::max(mcu_x, origin_x);
+        size_t x_end = std::min({frame_width_, origin_x + image.Width(), mcu_x + mcu_width});
+        if (x_begin >= x_end) {
+            return;
+        }
+        for (size_t y = std::max(mcu_y, origin_y); y < y_end; ++y) {
+            size_t offset = (y - mcu_y) * mcu_width + x_begin - mcu_x;
+            kernels_.ycbcr_to_rgb(luma_ + offset, chroma_[0] + offset, chroma_[1] + offset,
+                                  x_end - x_begin, red_, green_, blue_);
+            for (size_t x = x_begin; x < x_end; ++x) {
+                size_t id = x - x_begin;
+                image.SetPixel(y - origin_y, x - origin_x, RGB{red_[id], green_[id], blue_[id]});
+            }
+        }
+    }
+
+private:
+    const FrameLayout &layout_;
+    size_t frame_height_;
+    size_t frame_width_;
+    const DecoderKernels &kernels_;
+    // Planes of the current MCU with mcu_width stride, chroma already upsampled.
+    alignas(64) float luma_[kMaxMcuSize * kMaxMcuSize];
+    alignas(64) float chroma_[2][kMaxMcuSize * kMaxMcuSize];
+    int red_[kMaxMcuSize];
+    int green_[kMaxMcuSize];
+    int blue_[kMaxMcuSize];
+};
+
+// Writes the Y blocks of |scan| into |image|, which has the frame size.
+void PutLumaBlocks(const FrameLayout &layout, const ScanCoefficients &scan,
+                   const DecoderKernels &kernels, GrayImage &image);
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "bitreader.h"
+
+// Flat canonical-code decoder for a DHT table. Unlike HuffmanTree it keeps no
+// walking state, so one instance can be shared by several scan decoders.
+class HuffmanLookup {
+public:
+    static const int kLookBits = 9;
+    static const int kMaxLength = 16;
+
+    constexpr HuffmanLookup() : maxcode_(), valoffset_(), lookup_(), values_(), size_(0) {
+    }
+
+    // |code_lengths| holds the counts of codes of lengths 1..16, |values| their
+    // symbols in code order. Returns false if they do not describe a valid table.
+    constexpr bool Build(const uint8_t *code_lengths, const uint8_t *values) {
+        size_t total = 0;
+        for (int len = 0; len < kMaxLength; ++len) {
+            total += code_lengths[len];
+        }
+        if (total > values_.size()) {
+            return false;
+        }
+        for (auto &entry : lookup_) {
+            entry = 0;
+        }
+        int32_t code = 0;
+        size_t pos = 0;
+        for (int len = 1; len <= kMaxLength; ++len) {
+            size_t cnt = code_lengths[len - 1];
+            if (code + cnt > (1u << len)) {
+                return false;
+            }
+            valoffset_[len] = static_cast<int32_t>(pos) - code;
+            for (size_t id = 0; id < cnt; ++id, ++code, ++pos) {
+                values_[pos] = values[pos];
+                if (len <= kLookBits) {
+                    int shift = kLookBits - len;
+                    for (int32_t tail = 0; tail < (1 << shift); ++tail) {
+                        lookup_[(code << shift) | tail] = (len << 8) | values[pos];
+                    }
+                }
+            }
+            maxcode_[len] = cnt ? code - 1 : -1;
+            code <<= 1;
+        }
+        size_ = total;
+        return true;
+    }
+
+    constexpr size_t Size() const {
+        return size_;
+    }
+
+    const uint8_t *Values() const {
+        return values_.data();
+    }
+
+    // Returns the next symbol or -1 when the bits do not form a code.
+    int Decode(ScanBitReader &reader) const {
+        uint16_t entry = lookup_[reader.PeekBits(kLookBits)];
+        if (entry != 0) {
+            reader.SkipBits(entry >> 8);
+            return entry & 0xff;
+        }
+        uint32_t bits = reader.PeekBits(kMaxLength);
+        for (int len = kLookBits + 1; len <= kMaxLength; ++len) {
+            int32_t code = bits >> (kMaxLength - len);
+            if (code <= maxcode_[len]) {
+                reader.SkipBits(len);
+                return values_[valoffset_[len] + code];
+            }
+        }
+        return -1;
+    }
+
+private:
+    std::array<int32_t, kMaxLength + 1> maxcode_;
+    std::array<int32_t, kMaxLength + 1> valoffset_;
+    std::array<uint16_t, 1 << kLookBits> lookup_;
+    std::array<uint8_t, 256> values_;
+    size_t size_;
+};
@@ -0,0 +1,247 @@
+#include <image_cache.h>
+
+#include <content_hash.h>
+#include <algorithm>
+#include <cassert>
+#include <exception>
+#include <future>
+#include <istream>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+
+struct CacheKey {
+    uint64_t hash;
+    size_t size;
+    DecodeOptions options;
+
+    bool operator==(const CacheKey &other) const {
+        return hash == other.hash && size == other.size && options == other.options;
+    }
+};
+
+struct CacheKeyHash {
+    size_t operator()(const CacheKey &key) const {
+        uint64_t fields[] = {key.hash, key.size, key.options.crop_x, key.options.crop_y,
+                             key.options.crop_width, key.options.crop_height};
+        return HashBytes(reinterpret_cast<const uint8_t *>(fields), sizeof(fields));
+    }
+};
+
+// Read-only stream over bytes owned by the caller.
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const uint8_t *data, size_t size) {
+        auto *begin = reinterpret_cast<char *>(const_cast<uint8_t *>(data));
+        setg(begin, begin, begin + size);
+    }
+};
+
+using SharedResult = std::shared_ptr<const DecodeResult>;
+
+SharedResult DecodeWithOptions(const uint8_t *data, size_t size, const DecodeOptions &options) {
+    MemoryStreamBuf buffer(data, size);
+    std::istream input(&buffer);
+    auto result = std::make_shared<DecodeResult>(TryDecode(input));
+    const Image &image = result->image;
+    if (!result->Ok() || options.crop_width == 0 || options.crop_height == 0) {
+        return result;
+    }
+    size_t y_end = std::min(image.Height(), options.crop_y + options.crop_height);
+    size_t x_end = std::min(image.Width(), options.crop_x + options.crop_width);
+    Image cropped;
+    if (options.crop_y < y_end && options.crop_x < x_end) {
+        cropped.SetSize(x_end - options.crop_x, y_end - options.crop_y);
+        for (size_t y = options.crop_y; y < y_end; ++y) {
+            for (size_t x = options.crop_x; x < x_end; ++x) {
+                cropped.SetPixel(y - options.crop_y, x - options.crop_x, image.GetPixel(y, x));
+            }
+        }
+    }
+    cropped.SetComment(image.GetComment());
+    result->image = std::move(cropped);
+    return result;
+}
+
+}  // namespace
+
+size_t DecodeResultBytes(const DecodeResult &result) {
+    const Image &image = result.image;
+    return sizeof(DecodeResult) + image.Width() * image.Height() * sizeof(RGB) +
+           image.GetComment().size();
+}
+
+// One LRU with its own lock. An entry is inserted before its decode starts,
+// so later requests find it and wait on its future instead of decoding again.
+// Bytes are accounted both per shard and in the total of the cache.
+class ImageCache::Shard {
+public:
+    explicit Shard(std::atomic<size_t> &total_bytes) : total_bytes_(total_bytes), bytes_(0) {
+    }
+
+    struct Lookup {
+        std::shared_future<SharedResult> future;
+        // Set when the caller has to decode and fulfil the entry.
+        std::shared_ptr<std::promise<SharedResult>> promise;
+    };
+
+    Lookup Find(const CacheKey &key, bool &hit) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            hit = true;
+            return {it->second->future, nullptr};
+        }
+        hit = false;
+        auto promise = std::make_shared<std::promise<SharedResult>>();
+        lru_.push_front({key, promise->get_future().share(), 0, false});
+        index_[key] = lru_.begin();
+        return {lru_.front().future, promise};
+    }
+
+    // Accounts a finished decode. Failures and results larger than the whole
+    // |byte_budget| are dropped.
+    void Complete(const CacheKey &key, const SharedResult &result, size_t byte_budget) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Entries still decoding are never evicted or cleared.
+        auto it = index_.find(key);
+        assert(it != index_.end());
+        auto entry = it->second;
+        if (result == nullptr || !result->Ok() || DecodeResultBytes(*result) > byte_budget) {
+            lru_.erase(entry);
+            index_.erase(it);
+            return;
+        }
+        entry->bytes = DecodeResultBytes(*result);
+        entry->ready = true;
+        bytes_ += entry->bytes;
+        total_bytes_ += entry->bytes;
+    }
+
+    // Evicts the least recently used entry other than |keep|. Entries still
+    // decoding have no size yet and are never evicted. Returns false if there
+    // was nothing to evict.
+    bool EvictOldest(const CacheKey &keep) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto victim = lru_.end(); victim != lru_.begin();) {
+            --victim;
+            if (!victim->ready || victim->key == keep) {
+                continue;
+            }
+            bytes_ -= victim->bytes;
+            total_bytes_ -= victim->bytes;
+            index_.erase(victim->key);
+            lru_.erase(victim);
+            return true;
+        }
+        return false;
+    }
+
+    void Stats(ImageCacheStats &stats) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto &entry : lru_) {
+            stats.entries += entry.ready;
+        }
+        stats.bytes += bytes_;
+    }
+
+    // Entries still decoding stay, their callers wait on them.
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = lru_.begin(); it != lru_.end();) {
+            if (it->ready) {
+                index_.erase(it->key);
+                it = lru_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        total_bytes_ -= bytes_;
+        bytes_ = 0;
+    }
+
+private:
+    struct Entry {
+        CacheKey key;
+        std::shared_future<SharedResult> future;
+        size_t bytes;
+        bool ready;
+    };
+
+    std::atomic<size_t> &total_bytes_;
+    mutable std::mutex mutex_;
+    // Most recently used first.
+    std::list<Entry> lru_;
+    std::unordered_map<CacheKey, std::list<Entry>::iterator, CacheKeyHash> index_;
+    size_t bytes_;
+};
+
+ImageCache::ImageCache(size_t byte_budget, size_t shards)
+    : byte_budget_(byte_budget), bytes_(0), hits_(0), misses_(0), evictions_(0) {
+    if (shards == 0) {
+        throw std::invalid_argument("Zero shards in ImageCache");
+    }
+    for (size_t id = 0; id < shards; ++id) {
+        shards_.push_back(std::make_unique<Shard>(bytes_));
+    }
+}
+
+ImageCache::~ImageCache() = default;
+
+std::shared_ptr<const DecodeResult> ImageCache::Get(const uint8_t *data, size_t size,
+                                                    const DecodeOptions &options) {
+    CacheKey key{HashBytes(data, size), size, options};
+    size_t home = key.hash % shards_.size();
+    auto &shard = *shards_[home];
+    bool hit = false;
+    auto lookup = shard.Find(key, hit);
+    (hit ? hits_ : misses_).fetch_add(1, std::memory_order_relaxed);
+    if (lookup.promise == nullptr) {
+        return lookup.future.get();
+    }
+
+    SharedResult result;
+    try {
+        result = DecodeWithOptions(data, size, options);
+    } catch (...) {
+        // Waiters get the same error, the next request decodes again.
+        lookup.promise->set_exception(std::current_exception());
+        shard.Complete(key, nullptr, byte_budget_);
+        throw;
+    }
+    lookup.promise->set_value(result);
+    shard.Complete(key, result, byte_budget_);
+    // Shards share the budget: evict from the shard of the new entry first,
+    // then from the others. Only one shard is locked at a time.
+    for (size_t id = 0; bytes_.load() > byte_budget_ && id < shards_.size();) {
+        if (shards_[(home + id) % shards_.size()]->EvictOldest(key)) {
+            evictions_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            ++id;
+        }
+    }
+    return result;
+}
+
+ImageCacheStats ImageCache::Stats() const {
+    ImageCacheStats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.evictions = evictions_.load(std::memory_order_relaxed);
+    for (const auto &shard : shards_) {
+        shard->Stats(stats);
+    }
+    return stats;
+}
+
+void ImageCache::Clear() {
+    for (auto &shard : shards_) {
+        shard->Clear();
+    }
+}
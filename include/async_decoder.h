@@ -0,0 +1,46 @@
+#pragma once
+
+#include <decode_result.h>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+
+struct AsyncDecodeOptions {
+    // Files are read in chunks of this size.
+    size_t buffer_size = 1 << 20;
+    // Buffers shared by all files, bounds the data read ahead of the decoders.
+    size_t buffer_count = 16;
+    // Files decoded at the same time.
+    size_t decode_threads = 2;
+    // Reads go through io_uring when the kernel has it, otherwise through pread.
+    bool use_io_uring = true;
+};
+
+// Decodes files with reads issued ahead of the decoders. One thread keeps the
+// buffer ring busy with reads of the submitted files in submission order, so
+// the disk latency of the next files hides behind decoding of the current
+// ones. Within one file the overlap is limited: headers are parsed as chunks
+// arrive, but entropy decoding starts only once the whole scan is buffered,
+// since the parallel scan decoder splits the complete scan between threads.
+class AsyncDecoder {
+public:
+    explicit AsyncDecoder(const AsyncDecodeOptions &options = AsyncDecodeOptions());
+    // Waits for all submitted files.
+    ~AsyncDecoder();
+
+    AsyncDecoder(const AsyncDecoder &) = delete;
+    AsyncDecoder &operator=(const AsyncDecoder &) = delete;
+
+    // |callback| runs on a decoder thread and must not throw. Files that can't
+    // be read get DecodeStatus::kIoError.
+    void Decode(const std::string &path, std::function<void(DecodeResult)> callback);
+    std::future<DecodeResult> Decode(const std::string &path);
+
+    bool UsesIoUring() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> impl_;
+};
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// XXH64 of |size| bytes, fast enough to key caches by the file contents.
+uint64_t HashBytes(const uint8_t *data, size_t size, uint64_t seed = 0);
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Instruction set levels of the decoder kernels, ordered by capability.
+enum class CpuLevel { kScalar, kSse42, kAvx2, kAvx512 };
+
+const char *CpuLevelName(CpuLevel level);
+
+// Best level supported by both the build and the host.
+CpuLevel DetectCpuLevel();
+
+// Level used by the decoder. Defaults to DetectCpuLevel() unless the
+// JPEG_DECODER_CPU_LEVEL environment variable names a lower level
+// (scalar, sse4.2, avx2, avx512).
+CpuLevel GetCpuLevel();
+
+// Overrides the level for the rest of the process, throws std::invalid_argument
+// if the host can't run it.
+void ForceCpuLevel(CpuLevel level);
+
+// Hot loops of MCU reconstruction. Blocks are 64 values in natural order.
+struct DecoderKernels {
+    // Inverse DCT of dequantised coefficients with level shift, samples are
+    // clamped to [0, 255].
+    void (*idct)(const int16_t *coefs, float *block);
+    // dst[2 * i] = dst[2 * i + 1] = src[i] for i < count.
+    void (*upsample_h2)(const float *src, size_t count, float *dst);
+    // Writes count pixels as planar r, g, b values in [0, 255].
+    void (*ycbcr_to_rgb)(const float *y, const float *cb, const float *cr, size_t count, int *r,
+                         int *g, int *b);
+};
+
+// Kernels of |level|, which must not exceed DetectCpuLevel().
+const DecoderKernels &GetKernels(CpuLevel level);
+
+// Kernels of GetCpuLevel().
+const DecoderKernels &GetKernels();
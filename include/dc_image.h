@@ -0,0 +1,64 @@
+#pragma once
+
+#include <decode_result.h>
+#include <image.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <vector>
+
+// Dequantised DC coefficients of one component, one value per 8x8 block. The
+// mean sample of a block is value / 8 + 128.
+struct DcPlane {
+    // Blocks covering the image, padding blocks of partial MCUs are dropped.
+    size_t width = 0;
+    size_t height = 0;
+    // Image pixels covered by one block horizontally and vertically, 8 or 16
+    // for subsampled chroma.
+    size_t block_width = 8;
+    size_t block_height = 8;
+    std::vector<int16_t> values;
+
+    int16_t At(size_t y, size_t x) const {
+        return values[y * width + x];
+    }
+};
+
+// 1/8-scale view of a jpeg built from DC coefficients only.
+struct DcImage {
+    DecodeStatus status = DecodeStatus::kOk;
+    size_t width = 0;
+    size_t height = 0;
+    // Y, or Y, Cb and Cr.
+    std::vector<DcPlane> planes;
+
+    bool Ok() const {
+        return status == DecodeStatus::kOk;
+    }
+};
+
+// Entropy-decodes the scan keeping only DC values: AC coefficients are
+// skipped, there is no IDCT and no full-size buffer.
+DcImage ExtractDcImage(std::istream &input) noexcept;
+
+// Colour of the luma block (y, x), chroma is taken from the block covering it.
+RGB DcBlockColour(const DcImage &image, size_t y, size_t x);
+
+// Mean colour of the image, blocks weighted equally.
+RGB DcAverageColour(const DcImage &image);
+
+const size_t kDcHistogramBins = 16;
+
+// Per-channel (r, g, b) histograms of the block colours.
+std::array<std::array<uint32_t, kDcHistogramBins>, 3> DcColourHistogram(const DcImage &image);
+
+// Average hash: luma reduced to 8x8, one bit per cell brighter than the mean.
+uint64_t DcAverageHash(const DcImage &image);
+
+// DCT hash: luma reduced to 32x32, one bit per coefficient of the lowest 8x8
+// frequencies above their median.
+uint64_t DcDctHash(const DcImage &image);
+
+// Number of differing bits, small distances mean similar images.
+int HashDistance(uint64_t lhs, uint64_t rhs);
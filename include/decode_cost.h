@@ -0,0 +1,49 @@
+#pragma once
+
+#include <decode_result.h>
+#include <cstddef>
+#include <istream>
+
+// Frame parameters that drive the decode cost, read from SOF0 or SOF2.
+struct FrameInfo {
+    bool progressive = false;
+    size_t width = 0;
+    size_t height = 0;
+    size_t components = 0;
+    // Sampling factors of the first component, 1 for grayscale.
+    size_t hor_sampling = 1;
+    size_t vert_sampling = 1;
+    // Whether Decode handles this frame at all.
+    bool supported = false;
+    size_t restart_interval = 0;
+    size_t file_size = 0;
+};
+
+// Reads the markers up to the first scan, stops there without touching the
+// entropy-coded data. |file_size| is stored as is.
+DecodeStatus ReadFrameInfo(std::istream &input, size_t file_size, FrameInfo &info) noexcept;
+
+// Decode seconds = fixed + per_pixel * pixels + per_block * blocks + per_byte * file size,
+// where blocks counts the 8x8 blocks of all components.
+struct DecodeCostModel {
+    double fixed_seconds = 0;
+    double per_pixel = 0;
+    double per_block = 0;
+    double per_byte = 0;
+};
+
+struct DecodeCost {
+    // False when Decode would reject the frame right after its header.
+    bool supported = false;
+    // Heap used by Decode at its peak, the decoded image included.
+    size_t peak_bytes = 0;
+    double seconds = 0;
+};
+
+// Memory follows from the decoder's buffers, time from |model|.
+DecodeCost EstimateDecodeCost(const FrameInfo &frame, const DecodeCostModel &model);
+
+// Fits the model to timed decodes of synthetic jpegs of |pixels| and a quarter
+// of that, in every sampling and a low and a high quality. Takes a few seconds
+// at the default size, run it once per machine and keep the model.
+DecodeCostModel CalibrateDecodeCost(size_t pixels = 1 << 20);
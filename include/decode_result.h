@@ -0,0 +1,86 @@
+#pragma once
+
+#include <image.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <istream>
+
+enum class DecodeStatus {
+    kOk,
+    // The input ended before the image did.
+    kTruncated,
+    // Missing SOI, unknown marker or data after EOI.
+    kBadMarker,
+    kBadFrame,
+    kBadHuffmanTable,
+    kBadQuantTable,
+    kBadScanHeader,
+    kBadRestart,
+    // Entropy-coded data that does not decode to the announced blocks.
+    kBadScanData,
+    // Valid jpeg this decoder can't handle, e.g. progressive.
+    kUnsupported,
+    kOutOfMemory,
+    // The stream or the system failed while decoding.
+    kIoError,
+    // Stopped through DecodeControl.
+    kCancelled,
+    kDeadlineExceeded,
+    // The image has more pixels or needs more memory than allowed.
+    kLimitExceeded,
+};
+
+const char *DecodeStatusMessage(DecodeStatus status);
+
+struct DecodeResult {
+    DecodeStatus status = DecodeStatus::kOk;
+    Image image;
+
+    bool Ok() const {
+        return status == DecodeStatus::kOk;
+    }
+};
+
+// Set from any thread to stop the decodes watching it.
+class CancellationToken {
+public:
+    void Cancel() {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    bool Cancelled() const {
+        return cancelled_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<bool> cancelled_{false};
+};
+
+// Checked before allocating and then once per MCU row, so a stopped decode
+// gives its core back within a row of work.
+struct DecodeControl {
+    // Must outlive the decode, null for none.
+    const CancellationToken *cancel = nullptr;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    // Zero means no limit.
+    size_t max_pixels = 0;
+    // Peak heap of the decode as EstimateDecodeCost computes it.
+    size_t max_memory_bytes = 0;
+
+    // Status that stops the decode, kOk to go on.
+    DecodeStatus Check() const {
+        if (cancel != nullptr && cancel->Cancelled()) {
+            return DecodeStatus::kCancelled;
+        }
+        if (deadline != std::chrono::steady_clock::time_point::max() &&
+            std::chrono::steady_clock::now() >= deadline) {
+            return DecodeStatus::kDeadlineExceeded;
+        }
+        return DecodeStatus::kOk;
+    }
+};
+
+// Same as Decode, but reports errors through the status instead of throwing.
+DecodeResult TryDecode(std::istream &input) noexcept;
+DecodeResult TryDecode(std::istream &input, const DecodeControl &control) noexcept;
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <decode_result.h>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+// 8-bit single channel image, rows stored one after another.
+struct GrayImage {
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<uint8_t> pixels;
+    std::string comment;
+
+    uint8_t GetPixel(size_t y, size_t x) const {
+        return pixels[y * width + x];
+    }
+};
+
+struct GrayDecodeResult {
+    DecodeStatus status = DecodeStatus::kOk;
+    GrayImage image;
+
+    bool Ok() const {
+        return status == DecodeStatus::kOk;
+    }
+};
+
+// Decodes only the Y component. Cb and Cr blocks are skipped in the bitstream
+// and never reconstructed, grayscale jpegs give the same samples as Decode.
+GrayDecodeResult TryDecodeLuma(std::istream &input) noexcept;
+
+// Same as TryDecodeLuma, but throws std::runtime_error on failure.
+GrayImage DecodeLuma(std::istream &input);
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <decode_result.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Options that change the decoded pixels, part of the cache key.
+struct DecodeOptions {
+    // Window kept from the decoded image, clipped to it. Zero width or height
+    // keeps the whole image.
+    size_t crop_x = 0;
+    size_t crop_y = 0;
+    size_t crop_width = 0;
+    size_t crop_height = 0;
+
+    bool operator==(const DecodeOptions &other) const {
+        return crop_x == other.crop_x && crop_y == other.crop_y &&
+               crop_width == other.crop_width && crop_height == other.crop_height;
+    }
+};
+
+struct ImageCacheStats {
+    // Requests served by a cached image or by a decode already in progress.
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// Thread-safe LRU cache of decoded images keyed by the hash of the jpeg bytes
+// and the options. Concurrent requests for the same key wait for a single
+// decode. Failed decodes are shared with those waiters but not cached.
+class ImageCache {
+public:
+    // |byte_budget| bounds all |shards| together. Each shard is an
+    // independently locked LRU, eviction starts in the shard of the new entry,
+    // so the order is least recently used within a shard. Results larger than
+    // the whole budget are not cached.
+    explicit ImageCache(size_t byte_budget, size_t shards = 16);
+    ~ImageCache();
+
+    ImageCache(const ImageCache &) = delete;
+    ImageCache &operator=(const ImageCache &) = delete;
+
+    std::shared_ptr<const DecodeResult> Get(const uint8_t *data, size_t size,
+                                            const DecodeOptions &options = DecodeOptions());
+
+    ImageCacheStats Stats() const;
+    void Clear();
+
+private:
+    class Shard;
+
+    size_t byte_budget_;
+    std::atomic<size_t> bytes_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> evictions_;
+};
+
+// Memory held by a cached result.
+size_t DecodeResultBytes(const DecodeResult &result);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <image.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+// Point of the scan where sequential decoding can be resumed.
+struct McuIndexEntry {
+    // Position in the file of the first bit after the previous MCU.
+    uint64_t file_bit_pos;
+    std::array<int32_t, 3> pref_sum_dc;
+};
+
+// Entry i describes the state in front of MCU i * mcu_interval.
+struct McuIndex {
+    // Size and HashBytes of the whole jpeg the index was built from.
+    uint64_t source_size;
+    uint64_t source_hash;
+    uint64_t mcu_interval;
+    uint64_t mcu_count;
+    uint8_t component_count;
+    // Offset in the file of the EOI marker closing the scan.
+    uint64_t scan_end;
+    std::vector<McuIndexEntry> entries;
+};
+
+// Decodes the entropy-coded data of a baseline jpeg once and records an entry
+// every |mcu_interval| MCUs. The whole input is read to hash it.
+McuIndex BuildMcuIndex(std::istream &input, size_t mcu_interval);
+
+// Compact sidecar serialisation of the index. Reading throws unless the
+// sidecar is consistent and was built from the jpeg with |source_hash| and
+// |source_size|.
+void WriteMcuIndex(const McuIndex &index, std::ostream &output);
+McuIndex ReadMcuIndex(std::istream &input, uint64_t source_hash, uint64_t source_size);
+
+// Decodes the window of |width| x |height| pixels at (x, y) clipped to the
+// image. |input| must be seekable, only the scan bytes of the MCUs covering
+// the window and at most one index interval in front of each MCU row are read.
+// Only the size of |input| is checked against the index, not its hash.
+Image DecodeRegion(std::istream &input, const McuIndex &index, size_t x, size_t y, size_t width,
+                   size_t height);
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <decode_result.h>
+#include <gray_image.h>
+#include <image.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Raw decoded pixels stored next to a jpeg, so that later runs map them
+// instead of decoding again. The file is a 64-byte little-endian header
+// (magic, version, format, width, height, stride, source hash and size,
+// pixel offset) followed by rows padded to kSidecarAlignment bytes.
+const uint32_t kSidecarVersion = 1;
+const size_t kSidecarAlignment = 64;
+
+enum class PixelFormat : uint32_t {
+    // Interleaved r, g, b bytes.
+    kRgb8 = 1,
+    kGray8 = 2,
+};
+
+size_t BytesPerPixel(PixelFormat format);
+
+enum class SidecarStatus {
+    kOk,
+    kIoError,
+    // Not a sidecar, an unknown version or a truncated file.
+    kBadFormat,
+    // Written for other jpeg bytes.
+    kStale,
+};
+
+// Pixels owned by someone else, rows start kSidecarAlignment-aligned.
+struct PixelView {
+    PixelFormat format = PixelFormat::kRgb8;
+    size_t width = 0;
+    size_t height = 0;
+    size_t stride = 0;
+    const uint8_t *data = nullptr;
+
+    const uint8_t *Row(size_t y) const {
+        return data + y * stride;
+    }
+};
+
+// |source_hash| and |source_size| identify the jpeg, source_hash is HashBytes
+// of its contents. The file is written under a temporary name and renamed, so
+// readers never see a partial one.
+SidecarStatus WriteSidecar(const std::string &path, const PixelView &pixels, uint64_t source_hash,
+                           size_t source_size);
+SidecarStatus WriteSidecar(const std::string &path, const Image &image, uint64_t source_hash,
+                           size_t source_size);
+SidecarStatus WriteSidecar(const std::string &path, const GrayImage &image, uint64_t source_hash,
+                           size_t source_size);
+
+// Read-only mapping of a sidecar, the view points straight into it.
+class PixelSidecar {
+public:
+    PixelSidecar() = default;
+    ~PixelSidecar();
+
+    PixelSidecar(PixelSidecar &&other) noexcept;
+    PixelSidecar &operator=(PixelSidecar &&other) noexcept;
+    PixelSidecar(const PixelSidecar &) = delete;
+    PixelSidecar &operator=(const PixelSidecar &) = delete;
+
+    // Maps |path|, fails with kStale unless it was written for this jpeg.
+    SidecarStatus Open(const std::string &path, uint64_t source_hash, size_t source_size);
+
+    bool IsOpen() const {
+        return map_ != nullptr;
+    }
+
+    // Valid while the sidecar stays open.
+    const PixelView &View() const {
+        return view_;
+    }
+
+private:
+    void Close();
+
+    void *map_ = nullptr;
+    size_t map_size_ = 0;
+    PixelView view_;
+};
+
+// Maps the sidecar of |jpeg_path| if it is up to date, otherwise decodes the
+// jpeg, writes the sidecar and maps it. Sidecar failures are kIoError.
+DecodeStatus DecodeFileWithSidecar(const std::string &jpeg_path, const std::string &sidecar_path,
+                                   PixelFormat format, PixelSidecar &sidecar);
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <decode_result.h>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+
+struct ValidationReport {
+    DecodeStatus status = DecodeStatus::kOk;
+    // Frame parameters, filled once the header is parsed.
+    size_t width = 0;
+    size_t height = 0;
+    size_t components = 0;
+    size_t restart_interval = 0;
+    size_t mcu_count = 0;
+    // MCUs that decoded before the first error, mcu_count for valid files.
+    size_t valid_mcus = 0;
+    // Offset in the file where the error was found. For scan errors it is the
+    // start of the first MCU that failed, also when the scan is truncated or
+    // broken by a bad marker: the MCUs before that are checked first.
+    uint64_t error_offset = 0;
+    // Bytes after EOI, allowed but reported.
+    uint64_t trailing_bytes = 0;
+
+    bool Ok() const {
+        return status == DecodeStatus::kOk;
+    }
+};
+
+// Checks that |input| is a baseline jpeg Decode can fully decode: parses all
+// markers and Huffman-decodes every block, but skips dequantisation, IDCT,
+// colour conversion and the output image. A file without a scan is invalid.
+ValidationReport Validate(std::istream &input) noexcept;
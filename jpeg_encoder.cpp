@@ -0,0 +1,492 @@
+#include "jpeg_encoder.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "standard_huffman.h"
+#include "structures.h"
+
+namespace {
+
+// ITU T.81 Annex K.1 tables in natural order.
+const uint8_t kLumaQuant[64] = {
+    16, 11, 10, 16, 24,  40,  51,  61,  12, 12, 14, 19, 26,  58,  60,  55,
+    14, 13, 16, 24, 40,  57,  69,  56,  14, 17, 22, 29, 51,  87,  80,  62,
+    18, 22, 37, 56, 68,  109, 103, 77,  24, 35, 55, 64, 81,  104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+const uint8_t kChromaQuant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99, 24, 26, 56, 99, 99, 99,
+    99, 99, 47, 66, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+// Output is flushed to the stream in chunks of this size.
+const size_t kOutputChunk = 1 << 16;
+
+struct HuffmanCodes {
+    uint16_t code[256] = {};
+    uint8_t size[256] = {};
+};
+
+HuffmanCodes MakeCodes(const HuffmanSpec &spec) {
+    HuffmanCodes codes;
+    uint16_t code = 0;
+    size_t id = 0;
+    for (size_t len = 1; len <= HuffmanLookup::kMaxLength; ++len) {
+        for (size_t cnt = 0; cnt < spec.code_lengths[len - 1]; ++cnt, ++id) {
+            codes.code[spec.values[id]] = code++;
+            codes.size[spec.values[id]] = len;
+        }
+        code <<= 1;
+    }
+    return codes;
+}
+
+// Length-limited code of ITU T.81 Annex K.2 for symbols with |freq| counts.
+HuffmanSpec MakeOptimalSpec(const uint64_t *freq_counts) {
+    // One reserved symbol keeps any real code from being all ones.
+    uint64_t freq[257];
+    std::copy(freq_counts, freq_counts + 256, freq);
+    freq[256] = 1;
+    int code_size[257] = {};
+    int others[257];
+    std::fill(std::begin(others), std::end(others), -1);
+    while (true) {
+        int first = -1;
+        int second = -1;
+        // Least frequent two, the larger symbol wins ties.
+        for (int id = 0; id <= 256; ++id) {
+            if (freq[id] == 0) {
+                continue;
+            }
+            if (first < 0 || freq[id] <= freq[first]) {
+                second = first;
+                first = id;
+            } else if (second < 0 || freq[id] <= freq[second]) {
+                second = id;
+            }
+        }
+        if (second < 0) {
+            break;
+        }
+        freq[first] += freq[second];
+        freq[second] = 0;
+        for (++code_size[first]; others[first] >= 0; ++code_size[first]) {
+            first = others[first];
+        }
+        others[first] = second;
+        for (++code_size[second]; others[second] >= 0; ++code_size[second]) {
+            second = others[second];
+        }
+    }
+
+    int bits[33] = {};
+    for (int id = 0; id <= 256; ++id) {
+        if (code_size[id] > 0) {
+            ++bits[code_size[id]];
+        }
+    }
+    for (int len = 32; len > 16; --len) {
+        while (bits[len] > 0) {
+            int shorter = len - 2;
+            while (bits[shorter] == 0) {
+                --shorter;
+            }
+            bits[len] -= 2;
+            ++bits[len - 1];
+            bits[shorter + 1] += 2;
+            --bits[shorter];
+        }
+    }
+    int longest = 16;
+    while (bits[longest] == 0) {
+        --longest;
+    }
+    --bits[longest];
+
+    HuffmanSpec spec = {};
+    for (int len = 1; len <= 16; ++len) {
+        spec.code_lengths[len - 1] = bits[len];
+    }
+    for (int len = 1; len <= 32; ++len) {
+        for (int id = 0; id < 256; ++id) {
+            if (code_size[id] == len) {
+                spec.values[spec.size++] = id;
+            }
+        }
+    }
+    return spec;
+}
+
+std::array<uint8_t, 64> ScaleQuant(const uint8_t *base, int quality) {
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    std::array<uint8_t, 64> table;
+    for (size_t id = 0; id < 64; ++id) {
+        table[id] = std::clamp((base[id] * scale + 50) / 100, 1, 255);
+    }
+    return table;
+}
+
+class ByteSink {
+public:
+    explicit ByteSink(std::ostream &output) : output_(output) {
+        buffer_.reserve(kOutputChunk);
+    }
+
+    void Byte(uint8_t value) {
+        buffer_.push_back(static_cast<char>(value));
+        if (buffer_.size() >= kOutputChunk) {
+            Flush();
+        }
+    }
+
+    void Word(uint16_t value) {
+        Byte(value >> 8);
+        Byte(value & 255);
+    }
+
+    // Writes the accumulated bits with 0xff stuffing.
+    void Bits(uint32_t bits, int count) {
+        acc_ = (acc_ << count) | (bits & ((1u << count) - 1));
+        acc_size_ += count;
+        while (acc_size_ >= 8) {
+            acc_size_ -= 8;
+            uint8_t byte = acc_ >> acc_size_;
+            Byte(byte);
+            if (byte == 0xff) {
+                Byte(0);
+            }
+        }
+    }
+
+    // Pads the last byte with ones, as T.81 asks before a marker.
+    void AlignBits() {
+        if (acc_size_ > 0) {
+            Bits(0x7f, 8 - acc_size_);
+        }
+        acc_ = 0;
+    }
+
+    void Flush() {
+        output_.write(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+
+private:
+    std::ostream &output_;
+    std::string buffer_;
+    uint64_t acc_ = 0;
+    int acc_size_ = 0;
+};
+
+class Encoder {
+public:
+    Encoder(const EncoderOptions &options, std::ostream &output)
+        : options_(options), sink_(output) {
+        bool gray = options.subsampling == Subsampling::kGray;
+        components_ = gray ? 1 : 3;
+        hor_sampling_ = options.subsampling == Subsampling::k422 ||
+                                options.subsampling == Subsampling::k420
+                            ? 2
+                            : 1;
+        vert_sampling_ = options.subsampling == Subsampling::k420 ? 2 : 1;
+        quant_[0] = ScaleQuant(kLumaQuant, options.quality);
+        quant_[1] = ScaleQuant(kChromaQuant, options.quality);
+        for (size_t id = 0; id < 4; ++id) {
+            specs_[id] = kStandardHuffmanSpecs[id];
+        }
+        for (size_t freq = 0; freq < 8; ++freq) {
+            for (size_t pos = 0; pos < 8; ++pos) {
+                double norm = freq == 0 ? std::sqrt(0.125) : 0.5;
+                basis_[freq][pos] = norm * std::cos((2 * pos + 1) * freq * M_PI / 16);
+            }
+        }
+    }
+
+    void Encode(const RowSource &source) {
+        if (options_.optimize_huffman) {
+            counting_ = true;
+            EncodeScan(source);
+            for (size_t id = 0; id < 4; ++id) {
+                // Chroma tables of grayscale images stay unused.
+                if (std::any_of(freqs_[id], freqs_[id] + 256, [](uint64_t cnt) { return cnt; })) {
+                    specs_[id] = MakeOptimalSpec(freqs_[id]);
+                }
+            }
+            counting_ = false;
+        }
+        for (size_t id = 0; id < 4; ++id) {
+            codes_[id] = MakeCodes(specs_[id]);
+        }
+        WriteHeaders();
+        EncodeScan(source);
+        sink_.AlignBits();
+        sink_.Word(0xffd9);
+        sink_.Flush();
+    }
+
+private:
+    void EncodeScan(const RowSource &source) {
+        size_t mcu_width = 8 * hor_sampling_;
+        size_t mcu_height = 8 * vert_sampling_;
+        size_t mcu_cols = (options_.width + mcu_width - 1) / mcu_width;
+        size_t mcu_rows = (options_.height + mcu_height - 1) / mcu_height;
+        size_t padded_width = mcu_cols * mcu_width;
+        std::vector<uint8_t> row(options_.width * components_);
+        for (size_t comp = 0; comp < components_; ++comp) {
+            planes_[comp].assign(padded_width * mcu_height, 0);
+        }
+        size_t mcu = 0;
+        size_t restarts = 0;
+        for (size_t mcu_row = 0; mcu_row < mcu_rows; ++mcu_row) {
+            for (size_t line = 0; line < mcu_height; ++line) {
+                // Rows and columns past the image repeat the last ones.
+                size_t y = std::min(options_.height - 1, mcu_row * mcu_height + line);
+                source(y, row.data());
+                StoreLine(row.data(), line, padded_width);
+            }
+            for (size_t mcu_col = 0; mcu_col < mcu_cols; ++mcu_col, ++mcu) {
+                if (options_.restart_interval != 0 && mcu != 0 &&
+                    mcu % options_.restart_interval == 0) {
+                    if (!counting_) {
+                        sink_.AlignBits();
+                        sink_.Word(0xffd0 + restarts++ % 8);
+                    }
+                    std::fill(std::begin(pred_), std::end(pred_), 0);
+                }
+                EncodeMcu(mcu_col * mcu_width, padded_width);
+            }
+        }
+        std::fill(std::begin(pred_), std::end(pred_), 0);
+    }
+
+    void WriteHeaders() {
+        sink_.Word(0xffd8);
+        size_t tables = components_ == 1 ? 1 : 2;
+        sink_.Word(0xffdb);
+        sink_.Word(2 + 65 * tables);
+        for (size_t id = 0; id < tables; ++id) {
+            sink_.Byte(id);
+            for (size_t pos = 0; pos < 64; ++pos) {
+                sink_.Byte(quant_[id][kZigZagOrder[pos]]);
+            }
+        }
+
+        sink_.Word(0xffc0);
+        sink_.Word(8 + 3 * components_);
+        sink_.Byte(8);
+        sink_.Word(options_.height);
+        sink_.Word(options_.width);
+        sink_.Byte(components_);
+        for (size_t comp = 0; comp < components_; ++comp) {
+            sink_.Byte(comp + 1);
+            sink_.Byte(comp == 0 ? hor_sampling_ << 4 | vert_sampling_ : 0x11);
+            sink_.Byte(comp == 0 ? 0 : 1);
+        }
+
+        sink_.Word(0xffc4);
+        size_t length = 2;
+        for (size_t id = 0; id < 4; ++id) {
+            if (components_ == 3 || id % 2 == 0) {
+                length += 17 + specs_[id].size;
+            }
+        }
+        sink_.Word(length);
+        for (size_t id = 0; id < 4; ++id) {
+            if (components_ == 1 && id % 2 == 1) {
+                continue;
+            }
+            const auto &spec = specs_[id];
+            sink_.Byte((id / 2) << 4 | id % 2);
+            for (auto count : spec.code_lengths) {
+                sink_.Byte(count);
+            }
+            for (size_t pos = 0; pos < spec.size; ++pos) {
+                sink_.Byte(spec.values[pos]);
+            }
+        }
+
+        if (options_.restart_interval != 0) {
+            sink_.Word(0xffdd);
+            sink_.Word(4);
+            sink_.Word(options_.restart_interval);
+        }
+
+        sink_.Word(0xffda);
+        sink_.Word(6 + 2 * components_);
+        sink_.Byte(components_);
+        for (size_t comp = 0; comp < components_; ++comp) {
+            sink_.Byte(comp + 1);
+            sink_.Byte(comp == 0 ? 0x00 : 0x11);
+        }
+        sink_.Byte(0);
+        sink_.Byte(63);
+        sink_.Byte(0);
+    }
+
+    void StoreLine(const uint8_t *row, size_t line, size_t padded_width) {
+        for (size_t x = 0; x < padded_width; ++x) {
+            const uint8_t *src = row + std::min(options_.width - 1, x) * components_;
+            float *dst = &planes_[0][line * padded_width + x];
+            if (components_ == 1) {
+                *dst = src[0];
+                continue;
+            }
+            float red = src[0];
+            float green = src[1];
+            float blue = src[2];
+            *dst = 0.299f * red + 0.587f * green + 0.114f * blue;
+            planes_[1][line * padded_width + x] =
+                -0.168736f * red - 0.331264f * green + 0.5f * blue + 128;
+            planes_[2][line * padded_width + x] =
+                0.5f * red - 0.418688f * green - 0.081312f * blue + 128;
+        }
+    }
+
+    void EncodeMcu(size_t x, size_t stride) {
+        float block[64];
+        for (size_t by = 0; by < vert_sampling_; ++by) {
+            for (size_t bx = 0; bx < hor_sampling_; ++bx) {
+                for (size_t pos = 0; pos < 64; ++pos) {
+                    block[pos] = planes_[0][(by * 8 + pos / 8) * stride + x + bx * 8 + pos % 8];
+                }
+                EncodeBlock(block, 0);
+            }
+        }
+        for (size_t comp = 1; comp < components_; ++comp) {
+            // Chroma is averaged over the luma samples it covers.
+            for (size_t pos = 0; pos < 64; ++pos) {
+                float sum = 0;
+                for (size_t dy = 0; dy < vert_sampling_; ++dy) {
+                    for (size_t dx = 0; dx < hor_sampling_; ++dx) {
+                        sum += planes_[comp][(pos / 8 * vert_sampling_ + dy) * stride + x +
+                                             pos % 8 * hor_sampling_ + dx];
+                    }
+                }
+                block[pos] = sum / (hor_sampling_ * vert_sampling_);
+            }
+            EncodeBlock(block, comp);
+        }
+    }
+
+    void EncodeBlock(const float *samples, size_t comp) {
+        float rows[64];
+        for (size_t y = 0; y < 8; ++y) {
+            for (size_t u = 0; u < 8; ++u) {
+                float sum = 0;
+                for (size_t x = 0; x < 8; ++x) {
+                    sum += (samples[y * 8 + x] - 128) * basis_[u][x];
+                }
+                rows[y * 8 + u] = sum;
+            }
+        }
+        const auto &quant = quant_[comp == 0 ? 0 : 1];
+        int coefs[64];
+        for (size_t v = 0; v < 8; ++v) {
+            for (size_t u = 0; u < 8; ++u) {
+                float sum = 0;
+                for (size_t y = 0; y < 8; ++y) {
+                    sum += rows[y * 8 + u] * basis_[v][y];
+                }
+                // Baseline AC values have at most 10 bits.
+                int limit = v + u == 0 ? 2047 : 1023;
+                coefs[v * 8 + u] =
+                    std::clamp(static_cast<int>(std::lround(sum / quant[v * 8 + u])), -limit, limit);
+            }
+        }
+
+        size_t dc_table = comp == 0 ? 0 : 1;
+        size_t ac_table = comp == 0 ? 2 : 3;
+        int diff = coefs[0] - pred_[comp];
+        pred_[comp] = coefs[0];
+        int size = Magnitude(diff);
+        Emit(dc_table, size, diff, size);
+        int zeros = 0;
+        for (size_t pos = 1; pos < 64; ++pos) {
+            int value = coefs[kZigZagOrder[pos]];
+            if (value == 0) {
+                ++zeros;
+                continue;
+            }
+            for (; zeros >= 16; zeros -= 16) {
+                Emit(ac_table, 0xf0, 0, 0);
+            }
+            size = Magnitude(value);
+            Emit(ac_table, zeros << 4 | size, value, size);
+            zeros = 0;
+        }
+        if (zeros > 0) {
+            Emit(ac_table, 0, 0, 0);
+        }
+    }
+
+    // Writes |symbol| followed by the |size| low bits of |value|, or only
+    // counts it in the statistics pass.
+    void Emit(size_t table, int symbol, int value, int size) {
+        if (counting_) {
+            ++freqs_[table][symbol];
+            return;
+        }
+        sink_.Bits(codes_[table].code[symbol], codes_[table].size[symbol]);
+        sink_.Bits(value < 0 ? value - 1 : value, size);
+    }
+
+    static int Magnitude(int value) {
+        int size = 0;
+        for (value = std::abs(value); value != 0; value >>= 1) {
+            ++size;
+        }
+        return size;
+    }
+
+    const EncoderOptions &options_;
+    ByteSink sink_;
+    size_t components_;
+    size_t hor_sampling_;
+    size_t vert_sampling_;
+    std::array<uint8_t, 64> quant_[2];
+    HuffmanSpec specs_[4];
+    HuffmanCodes codes_[4];
+    // Symbol counts of the statistics pass of optimize_huffman.
+    bool counting_ = false;
+    uint64_t freqs_[4][256] = {};
+    float basis_[8][8];
+    // Full-resolution Y, Cb, Cr of the current MCU row.
+    std::vector<float> planes_[3];
+    int pred_[3] = {0, 0, 0};
+};
+
+}  // namespace
+
+void EncodeJpeg(const EncoderOptions &options, const RowSource &source, std::ostream &output) {
+    if (options.width == 0 || options.height == 0 || options.width > 65535 ||
+        options.height > 65535) {
+        throw std::invalid_argument("Bad size in EncodeJpeg");
+    }
+    if (options.quality < 1 || options.quality > 100) {
+        throw std::invalid_argument("Bad quality in EncodeJpeg");
+    }
+    if (options.restart_interval > 65535) {
+        throw std::invalid_argument("Bad restart interval in EncodeJpeg");
+    }
+    Encoder(options, output).Encode(source);
+}
+
+RowSource MakeSyntheticSource(size_t width, bool gray, uint64_t seed) {
+    size_t channels = gray ? 1 : 3;
+    return [width, channels, seed](size_t y, uint8_t *row) {
+        uint64_t state = seed * 0x9E3779B97F4A7C15ull + y + 1;
+        for (size_t x = 0; x < width * channels; ++x) {
+            // xorshift64*, the noise of every row only depends on the seed and y.
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            uint32_t noise = (state * 0x2545F4914F6CDD1Dull) >> 59;
+            size_t pos = x / channels;
+            row[x] = static_cast<uint8_t>(((pos * 7 + y * 3) ^ (pos * y / 13)) +
+                                          x % channels * 85 + noise);
+        }
+    };
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+
+enum class Subsampling { kGray, k444, k422, k420 };
+
+struct EncoderOptions {
+    size_t width = 0;
+    size_t height = 0;
+    Subsampling subsampling = Subsampling::k420;
+    // IJG quality scale of the Annex K quant tables, 1 to 100.
+    int quality = 75;
+    // MCUs per restart interval, 0 for none.
+    size_t restart_interval = 0;
+    // Builds the Huffman tables from the image's own statistics instead of
+    // using Annex K, at the cost of a second pass over the source.
+    bool optimize_huffman = false;
+};
+
+// Fills row |y| with width r, g, b triples, or width gray samples.
+using RowSource = std::function<void(size_t y, uint8_t *row)>;
+
+// Writes a baseline jpeg. Rows are pulled one MCU row at a time, so the image
+// is never held in memory, the same rows may be asked for twice. Throws
+// std::invalid_argument on bad options.
+void EncodeJpeg(const EncoderOptions &options, const RowSource &source, std::ostream &output);
+
+// Deterministic gradients with noise, compressible like a photo rather than
+// like a flat fill or white noise.
+RowSource MakeSyntheticSource(size_t width, bool gray, uint64_t seed);
@@ -0,0 +1,328 @@
+#include <cpu_dispatch.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JPEG_X86_KERNELS
+#endif
+
+namespace {
+
+const float kRCr = 1.402f;
+const float kGCb = 0.114f * 1.772f / 0.587f;
+const float kGCr = 0.299f * 1.402f / 0.587f;
+const float kBCb = 1.772f;
+
+struct KernelTables {
+    // basis[k][n] = c(k) / 2 * cos((2n + 1) k pi / 16), one row per frequency.
+    float basis[8][8];
+    // For the two-rows-at-once passes: every basis row duplicated into both
+    // halves, and for columns m, m + 1 the pair [basis[j][m] x8 | basis[j][m + 1] x8].
+    float basis_dup[8][16];
+    float basis_pair[4][8][16];
+};
+
+KernelTables MakeKernelTables() {
+    KernelTables tables;
+    for (int k = 0; k < 8; ++k) {
+        for (int n = 0; n < 8; ++n) {
+            double scale = k == 0 ? std::sqrt(0.5) : 1.0;
+            tables.basis[k][n] = 0.5 * scale * std::cos((2 * n + 1) * k * M_PI / 16);
+        }
+    }
+    for (int k = 0; k < 8; ++k) {
+        for (int n = 0; n < 16; ++n) {
+            tables.basis_dup[k][n] = tables.basis[k][n % 8];
+        }
+    }
+    for (int m = 0; m < 4; ++m) {
+        for (int j = 0; j < 8; ++j) {
+            for (int n = 0; n < 16; ++n) {
+                tables.basis_pair[m][j][n] = tables.basis[j][2 * m + n / 8];
+            }
+        }
+    }
+    return tables;
+}
+
+const KernelTables kTables = MakeKernelTables();
+
+int ClampSample(int val) {
+    return std::min(std::max(0, val), 255);
+}
+
+void IdctScalar(const int16_t *coefs, float *block) {
+    float tmp[64];
+    for (int row = 0; row < 8; ++row) {
+        for (int n = 0; n < 8; ++n) {
+            float sum = 0;
+            for (int k = 0; k < 8; ++k) {
+                sum += coefs[row * 8 + k] * kTables.basis[k][n];
+            }
+            tmp[row * 8 + n] = sum;
+        }
+    }
+    for (int m = 0; m < 8; ++m) {
+        for (int n = 0; n < 8; ++n) {
+            float sum = 0;
+            for (int j = 0; j < 8; ++j) {
+                sum += kTables.basis[j][m] * tmp[j * 8 + n];
+            }
+            block[m * 8 + n] = std::min(255.f, std::max(0.f, sum + 128));
+        }
+    }
+}
+
+void UpsampleH2Scalar(const float *src, size_t count, float *dst) {
+    for (size_t id = 0; id < count; ++id) {
+        dst[2 * id] = dst[2 * id + 1] = src[id];
+    }
+}
+
+void YCbCrToRgbScalar(const float *y, const float *cb, const float *cr, size_t count, int *r,
+                      int *g, int *b) {
+    for (size_t id = 0; id < count; ++id) {
+        float cb_shift = cb[id] - 128;
+        float cr_shift = cr[id] - 128;
+        r[id] = ClampSample(static_cast<int>(y[id] + kRCr * cr_shift));
+        g[id] = ClampSample(static_cast<int>(y[id] - (kGCb * cb_shift + kGCr * cr_shift)));
+        b[id] = ClampSample(static_cast<int>(y[id] + kBCb * cb_shift));
+    }
+}
+
+#ifdef JPEG_X86_KERNELS
+
+__attribute__((target("sse4.2"))) void IdctSse42(const int16_t *coefs, float *block) {
+    float tmp[64];
+    for (int row = 0; row < 8; ++row) {
+        __m128 lo = _mm_setzero_ps();
+        __m128 hi = _mm_setzero_ps();
+        for (int k = 0; k < 8; ++k) {
+            __m128 coef = _mm_set1_ps(coefs[row * 8 + k]);
+            lo = _mm_add_ps(lo, _mm_mul_ps(coef, _mm_loadu_ps(kTables.basis[k])));
+            hi = _mm_add_ps(hi, _mm_mul_ps(coef, _mm_loadu_ps(kTables.basis[k] + 4)));
+        }
+        _mm_storeu_ps(tmp + row * 8, lo);
+        _mm_storeu_ps(tmp + row * 8 + 4, hi);
+    }
+    __m128 shift = _mm_set1_ps(128);
+    __m128 low = _mm_setzero_ps();
+    __m128 high = _mm_set1_ps(255);
+    for (int m = 0; m < 8; ++m) {
+        __m128 lo = shift;
+        __m128 hi = shift;
+        for (int j = 0; j < 8; ++j) {
+            __m128 coef = _mm_set1_ps(kTables.basis[j][m]);
+            lo = _mm_add_ps(lo, _mm_mul_ps(coef, _mm_loadu_ps(tmp + j * 8)));
+            hi = _mm_add_ps(hi, _mm_mul_ps(coef, _mm_loadu_ps(tmp + j * 8 + 4)));
+        }
+        _mm_storeu_ps(block + m * 8, _mm_min_ps(high, _mm_max_ps(low, lo)));
+        _mm_storeu_ps(block + m * 8 + 4, _mm_min_ps(high, _mm_max_ps(low, hi)));
+    }
+}
+
+__attribute__((target("sse4.2"))) void UpsampleH2Sse42(const float *src, size_t count,
+                                                       float *dst) {
+    size_t id = 0;
+    for (; id + 4 <= count; id += 4) {
+        __m128 vals = _mm_loadu_ps(src + id);
+        _mm_storeu_ps(dst + 2 * id, _mm_unpacklo_ps(vals, vals));
+        _mm_storeu_ps(dst + 2 * id + 4, _mm_unpackhi_ps(vals, vals));
+    }
+    UpsampleH2Scalar(src + id, count - id, dst + 2 * id);
+}
+
+__attribute__((target("sse4.2"))) void YCbCrToRgbSse42(const float *y, const float *cb,
+                                                       const float *cr, size_t count, int *r,
+                                                       int *g, int *b) {
+    __m128 center = _mm_set1_ps(128);
+    __m128i low = _mm_setzero_si128();
+    __m128i high = _mm_set1_epi32(255);
+    size_t id = 0;
+    for (; id + 4 <= count; id += 4) {
+        __m128 luma = _mm_loadu_ps(y + id);
+        __m128 cb_shift = _mm_sub_ps(_mm_loadu_ps(cb + id), center);
+        __m128 cr_shift = _mm_sub_ps(_mm_loadu_ps(cr + id), center);
+        __m128 red = _mm_add_ps(luma, _mm_mul_ps(_mm_set1_ps(kRCr), cr_shift));
+        __m128 green = _mm_sub_ps(luma, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(kGCb), cb_shift),
+                                                   _mm_mul_ps(_mm_set1_ps(kGCr), cr_shift)));
+        __m128 blue = _mm_add_ps(luma, _mm_mul_ps(_mm_set1_ps(kBCb), cb_shift));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(r + id),
+                         _mm_min_epi32(high, _mm_max_epi32(low, _mm_cvttps_epi32(red))));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(g + id),
+                         _mm_min_epi32(high, _mm_max_epi32(low, _mm_cvttps_epi32(green))));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(b + id),
+                         _mm_min_epi32(high, _mm_max_epi32(low, _mm_cvttps_epi32(blue))));
+    }
+    YCbCrToRgbScalar(y + id, cb + id, cr + id, count - id, r + id, g + id, b + id);
+}
+
+__attribute__((target("avx2,fma"))) void IdctAvx2(const int16_t *coefs, float *block) {
+    __m256 basis[8];
+    for (int k = 0; k < 8; ++k) {
+        basis[k] = _mm256_loadu_ps(kTables.basis[k]);
+    }
+    __m256 tmp[8];
+    for (int row = 0; row < 8; ++row) {
+        __m256 acc = _mm256_setzero_ps();
+        for (int k = 0; k < 8; ++k) {
+            acc = _mm256_fmadd_ps(_mm256_set1_ps(coefs[row * 8 + k]), basis[k], acc);
+        }
+        tmp[row] = acc;
+    }
+    __m256 low = _mm256_setzero_ps();
+    __m256 high = _mm256_set1_ps(255);
+    for (int m = 0; m < 8; ++m) {
+        __m256 acc = _mm256_set1_ps(128);
+        for (int j = 0; j < 8; ++j) {
+            acc = _mm256_fmadd_ps(_mm256_set1_ps(kTables.basis[j][m]), tmp[j], acc);
+        }
+        _mm256_storeu_ps(block + m * 8, _mm256_min_ps(high, _mm256_max_ps(low, acc)));
+    }
+}
+
+__attribute__((target("avx2,fma"))) void UpsampleH2Avx2(const float *src, size_t count,
+                                                        float *dst) {
+    size_t id = 0;
+    for (; id + 8 <= count; id += 8) {
+        __m256 vals = _mm256_loadu_ps(src + id);
+        __m256 lo = _mm256_unpacklo_ps(vals, vals);
+        __m256 hi = _mm256_unpackhi_ps(vals, vals);
+        _mm256_storeu_ps(dst + 2 * id, _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(dst + 2 * id + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+    }
+    UpsampleH2Sse42(src + id, count - id, dst + 2 * id);
+}
+
+__attribute__((target("avx2,fma"))) void YCbCrToRgbAvx2(const float *y, const float *cb,
+                                                        const float *cr, size_t count, int *r,
+                                                        int *g, int *b) {
+    __m256 center = _mm256_set1_ps(128);
+    __m256i low = _mm256_setzero_si256();
+    __m256i high = _mm256_set1_epi32(255);
+    size_t id = 0;
+    for (; id + 8 <= count; id += 8) {
+        __m256 luma = _mm256_loadu_ps(y + id);
+        __m256 cb_shift = _mm256_sub_ps(_mm256_loadu_ps(cb + id), center);
+        __m256 cr_shift = _mm256_sub_ps(_mm256_loadu_ps(cr + id), center);
+        __m256 red = _mm256_add_ps(luma, _mm256_mul_ps(_mm256_set1_ps(kRCr), cr_shift));
+        __m256 green =
+            _mm256_sub_ps(luma, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(kGCb), cb_shift),
+                                              _mm256_mul_ps(_mm256_set1_ps(kGCr), cr_shift)));
+        __m256 blue = _mm256_add_ps(luma, _mm256_mul_ps(_mm256_set1_ps(kBCb), cb_shift));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(r + id),
+                            _mm256_min_epi32(high, _mm256_max_epi32(low, _mm256_cvttps_epi32(red))));
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i *>(g + id),
+            _mm256_min_epi32(high, _mm256_max_epi32(low, _mm256_cvttps_epi32(green))));
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i *>(b + id),
+            _mm256_min_epi32(high, _mm256_max_epi32(low, _mm256_cvttps_epi32(blue))));
+    }
+    YCbCrToRgbSse42(y + id, cb + id, cr + id, count - id, r + id, g + id, b + id);
+}
+
+// Works on two rows per register: the low half holds row 2i, the high one row 2i + 1.
+__attribute__((target("avx512f,avx2,fma"))) void IdctAvx512(const int16_t *coefs, float *block) {
+    __m512 tmp[4];
+    for (int row = 0; row < 8; row += 2) {
+        __m512 acc = _mm512_setzero_ps();
+        for (int k = 0; k < 8; ++k) {
+            __m512 coef = _mm512_mask_blend_ps(0xff00, _mm512_set1_ps(coefs[row * 8 + k]),
+                                               _mm512_set1_ps(coefs[row * 8 + 8 + k]));
+            acc = _mm512_fmadd_ps(coef, _mm512_loadu_ps(kTables.basis_dup[k]), acc);
+        }
+        tmp[row / 2] = acc;
+    }
+    // Row j of the intermediate block duplicated into both halves.
+    __m512 rows[8];
+    for (int j = 0; j < 8; ++j) {
+        __m512 pair = tmp[j / 2];
+        rows[j] = j % 2 == 0 ? _mm512_shuffle_f32x4(pair, pair, _MM_SHUFFLE(1, 0, 1, 0))
+                             : _mm512_shuffle_f32x4(pair, pair, _MM_SHUFFLE(3, 2, 3, 2));
+    }
+    __m512 low = _mm512_setzero_ps();
+    __m512 high = _mm512_set1_ps(255);
+    for (int m = 0; m < 4; ++m) {
+        __m512 acc = _mm512_set1_ps(128);
+        for (int j = 0; j < 8; ++j) {
+            acc = _mm512_fmadd_ps(_mm512_loadu_ps(kTables.basis_pair[m][j]), rows[j], acc);
+        }
+        _mm512_storeu_ps(block + m * 16, _mm512_min_ps(high, _mm512_max_ps(low, acc)));
+    }
+}
+
+__attribute__((target("avx512f,avx2,fma"))) void UpsampleH2Avx512(const float *src, size_t count,
+                                                                  float *dst) {
+    __m512i lo_idx = _mm512_set_epi32(7, 7, 6, 6, 5, 5, 4, 4, 3, 3, 2, 2, 1, 1, 0, 0);
+    __m512i hi_idx = _mm512_set_epi32(15, 15, 14, 14, 13, 13, 12, 12, 11, 11, 10, 10, 9, 9, 8, 8);
+    size_t id = 0;
+    for (; id + 16 <= count; id += 16) {
+        __m512 vals = _mm512_loadu_ps(src + id);
+        _mm512_storeu_ps(dst + 2 * id, _mm512_permutexvar_ps(lo_idx, vals));
+        _mm512_storeu_ps(dst + 2 * id + 16, _mm512_permutexvar_ps(hi_idx, vals));
+    }
+    UpsampleH2Avx2(src + id, count - id, dst + 2 * id);
+}
+
+__attribute__((target("avx512f,avx2,fma"))) void YCbCrToRgbAvx512(const float *y,
+                                                                  const float *cb,
+                                                                  const float *cr, size_t count,
+                                                                  int *r, int *g, int *b) {
+    __m512 center = _mm512_set1_ps(128);
+    __m512i low = _mm512_setzero_si512();
+    __m512i high = _mm512_set1_epi32(255);
+    size_t id = 0;
+    for (; id + 16 <= count; id += 16) {
+        __m512 luma = _mm512_loadu_ps(y + id);
+        __m512 cb_shift = _mm512_sub_ps(_mm512_loadu_ps(cb + id), center);
+        __m512 cr_shift = _mm512_sub_ps(_mm512_loadu_ps(cr + id), center);
+        __m512 red = _mm512_add_ps(luma, _mm512_mul_ps(_mm512_set1_ps(kRCr), cr_shift));
+        __m512 green =
+            _mm512_sub_ps(luma, _mm512_add_ps(_mm512_mul_ps(_mm512_set1_ps(kGCb), cb_shift),
+                                              _mm512_mul_ps(_mm512_set1_ps(kGCr), cr_shift)));
+        __m512 blue = _mm512_add_ps(luma, _mm512_mul_ps(_mm512_set1_ps(kBCb), cb_shift));
+        _mm512_storeu_si512(r + id,
+                            _mm512_min_epi32(high, _mm512_max_epi32(low, _mm512_cvttps_epi32(red))));
+        _mm512_storeu_si512(
+            g + id, _mm512_min_epi32(high, _mm512_max_epi32(low, _mm512_cvttps_epi32(green))));
+        _mm512_storeu_si512(
+            b + id, _mm512_min_epi32(high, _mm512_max_epi32(low, _mm512_cvttps_epi32(blue))));
+    }
+    YCbCrToRgbAvx2(y + id, cb + id, cr + id, count - id, r + id, g + id, b + id);
+}
+
+#endif
+
+const DecoderKernels kScalarKernels = {IdctScalar, UpsampleH2Scalar, YCbCrToRgbScalar};
+
+#ifdef JPEG_X86_KERNELS
+const DecoderKernels kSse42Kernels = {IdctSse42, UpsampleH2Sse42, YCbCrToRgbSse42};
+const DecoderKernels kAvx2Kernels = {IdctAvx2, UpsampleH2Avx2, YCbCrToRgbAvx2};
+const DecoderKernels kAvx512Kernels = {IdctAvx512, UpsampleH2Avx512, YCbCrToRgbAvx512};
+#endif
+
+}  // namespace
+
+const DecoderKernels &GetKernels(CpuLevel level) {
+    if (level > DetectCpuLevel()) {
+        throw std::invalid_argument(std::string("CPU level is not supported: ") +
+                                    CpuLevelName(level));
+    }
+    switch (level) {
+#ifdef JPEG_X86_KERNELS
+        case CpuLevel::kAvx512:
+            return kAvx512Kernels;
+        case CpuLevel::kAvx2:
+            return kAvx2Kernels;
+        case CpuLevel::kSse42:
+            return kSse42Kernels;
+#endif
+        default:
+            return kScalarKernels;
+    }
+}
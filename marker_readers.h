@@ -1,26 +1,31 @@
 #pragma once
 
-#include <cassert>
+#include <decode_result.h>
 #include <cstddef>
 #include <cstdint>
-#include <stdexcept>
+#include <memory>
+#include <string>
 #include <unordered_map>
 #include <vector>
 #include "structures.h"
 #include "bitreader.h"
+#include "scan_data.h"
+#include "standard_huffman.h"
 #include "util_funcs.h"
 #include <glog/logging.h>
 
-std::unordered_map<size_t, FrameParametrs> ReadSOF0(BitReader &reader, uint16_t &height,
-                                                    uint16_t &width) {
-    std::unordered_map<size_t, FrameParametrs> frames_pars;
+DecodeStatus ReadSOF0(BitReader &reader, JpegHeader &header) {
+    auto &frames_pars = header.frames_pars;
     uint16_t size = reader.GetDoubleByte() - 2;
-    reader.GetByte();                     // P
-    height = reader.GetDoubleByte();      // Y
-    width = reader.GetDoubleByte();       // X
-    size_t frame_cnt = reader.GetByte();  // Nf
+    reader.GetByte();                            // P
+    header.height = reader.GetDoubleByte();      // Y
+    header.width = reader.GetDoubleByte();       // X
+    size_t frame_cnt = reader.GetByte();         // Nf
+    if (reader.Failed()) {
+        return DecodeStatus::kTruncated;
+    }
     if (size != 3 * frame_cnt + 6) {
-        throw std::runtime_error("Bad parametrs in SOF0");
+        return DecodeStatus::kBadFrame;
     }
     for (size_t id = 0; id < frame_cnt; ++id) {
         FrameParametrs pars;
@@ -29,68 +34,83 @@ std::unordered_map<size_t, FrameParametrs> ReadSOF0(BitReader &reader, uint16_t
         pars.hor_sampling = reader.CheckLastByte() >> 4;
         pars.vert_sampling = reader.CheckLastByte() & 15;
         pars.qtable_dest = reader.GetByte();  // Tq_i
+        if (reader.Failed()) {
+            return DecodeStatus::kTruncated;
+        }
         if ((pars.hor_sampling < 1 || pars.hor_sampling > 4) ||
             (pars.vert_sampling < 1 || pars.vert_sampling > 4) || pars.qtable_dest > 3 ||
             frames_pars.count(pars.label)) {
-            throw std::runtime_error("Bad parametrs in SOF0");
+            return DecodeStatus::kBadFrame;
         }
 
         frames_pars[pars.label] = pars;
     }
-    return frames_pars;
+    return DecodeStatus::kOk;
 }
 
-std::vector<HuffTabParametrs> ReadDHT(BitReader &reader) {
+// Standard tables reuse the prebuilt lookups, only custom ones are built and
+// allocated per image.
+DecodeStatus ReadDHT(BitReader &reader, JpegHeader &header) {
     int size = reader.GetDoubleByte() - 2;
-    std::vector<HuffTabParametrs> tables;
+    uint8_t code_lengths[HuffTabParametrs::kMaxSize];
+    uint8_t values[256];
     while (size > 0) {
-        tables.push_back({});
-        HuffTabParametrs &tab = tables.back();
+        HuffTabParametrs tab;
         reader.GetByte();  // Tc|Th
         size -= 1;
         tab.table_class = reader.CheckLastByte() >> 4;
         tab.table_id = reader.CheckLastByte() & 15;
         if (!(tab.table_class <= 1 && tab.table_id <= 1)) {
-            throw std::runtime_error("Bad parametrs in DHT");
+            return reader.Failed() ? DecodeStatus::kTruncated : DecodeStatus::kBadHuffmanTable;
         }
 
-        for (size_t id = 0; id < HuffTabParametrs::kMaxSize; ++id) {
-            tab.lenghts.push_back(reader.GetByte());
-            size -= reader.CheckLastByte() + 1;
-        }
-        for (size_t id = 0; id < HuffTabParametrs::kMaxSize; ++id) {
-            std::vector<uint8_t> vals(tab.lenghts[id]);
-            for (auto &val : vals) {
-                val = reader.GetByte();
-            }
-            for (const auto &val : vals) {
-                tab.values.push_back(val);
+        size_t total = 0;
+        for (auto &cnt : code_lengths) {
+            cnt = reader.GetByte();
+            total += cnt;
+        }
+        size -= HuffTabParametrs::kMaxSize + total;
+        if (total > sizeof(values)) {
+            return reader.Failed() ? DecodeStatus::kTruncated : DecodeStatus::kBadHuffmanTable;
+        }
+        for (size_t id = 0; id < total; ++id) {
+            values[id] = reader.GetByte();
+        }
+        if (reader.Failed()) {
+            return DecodeStatus::kTruncated;
+        }
+        tab.huffman = FindStandardHuffmanTable(code_lengths, values, total);
+        if (tab.huffman == nullptr) {
+            auto custom = std::make_unique<HuffmanLookup>();
+            if (!custom->Build(code_lengths, values)) {
+                return DecodeStatus::kBadHuffmanTable;
             }
+            tab.huffman = custom.get();
+            header.custom_huffman_tables.push_back(std::move(custom));
         }
-        tab.huffman.Build(tab.lenghts, tab.values);
+        header.huffman_tables.push_back(tab);
     }
 
     if (size != 0) {
-        throw std::runtime_error("Bad parametrs in DHT");
+        return DecodeStatus::kBadHuffmanTable;
     }
-    return tables;
+    return DecodeStatus::kOk;
 }
 
-std::vector<QuantTable> ReadDQT(BitReader &reader) {
+DecodeStatus ReadDQT(BitReader &reader, std::vector<QuantTable> &tabs) {
     uint16_t size = reader.GetDoubleByte() - 2;
     if (size == 0 || size % 65 != 0) {
-        throw std::runtime_error("Bad size in DQT");
+        return reader.Failed() ? DecodeStatus::kTruncated : DecodeStatus::kBadQuantTable;
     }
-    std::vector<QuantTable> tabs(size / 65);
     for (size_t cnt = 0; cnt < size / 65; ++cnt) {
-        QuantTable &tab = tabs[cnt];
+        QuantTable tab;
         reader.GetByte();  // Pq|Tq
         if ((reader.CheckLastByte() >> 4) != 0) {
-            throw std::runtime_error("Bad Pq in DQT");
+            return DecodeStatus::kBadQuantTable;
         }
         tab.table_dest = reader.CheckLastByte() & 15;
         if (tab.table_dest > 3) {
-            throw std::runtime_error("Bad Tq in DQT");
+            return DecodeStatus::kBadQuantTable;
         }
         std::vector<int> all_els;
         for (size_t x = 0; x < QuantTable::kTableSize; ++x) {
@@ -98,17 +118,24 @@ std::vector<QuantTable> ReadDQT(BitReader &reader) {
                 all_els.push_back(reader.GetByte());
             }
         }
-        tab.table = ZigZagConvert(all_els);
+        if (reader.Failed()) {
+            return DecodeStatus::kTruncated;
+        }
+        tab.table = ZigZagConvert(all_els.data());
+        tabs.push_back(tab);
     }
-    return tabs;
+    return DecodeStatus::kOk;
 }
 
-void ReadSOS(BitReader &reader, std::unordered_map<size_t, FrameParametrs> &frame_pars) {
+DecodeStatus ReadSOS(BitReader &reader, std::unordered_map<size_t, FrameParametrs> &frame_pars) {
     uint16_t size = reader.GetDoubleByte() - 2;  // NOLINT
     uint8_t comp_cnt = reader.GetByte();
     size -= 1;
+    if (reader.Failed()) {
+        return DecodeStatus::kTruncated;
+    }
     if (frame_pars.size() != comp_cnt) {
-        throw std::runtime_error("Bad count of components in ReadSOS");
+        return DecodeStatus::kBadScanHeader;
     }
     for (size_t id = 0; id < comp_cnt; ++id) {
         uint8_t comp_num = reader.GetByte();  // Cs
@@ -116,52 +143,80 @@ void ReadSOS(BitReader &reader, std::unordered_map<size_t, FrameParametrs> &fram
         size -= 2;
         uint8_t td = reader.CheckLastByte() >> 4;
         uint8_t ta = reader.CheckLastByte() & 15;
+        if (reader.Failed()) {
+            return DecodeStatus::kTruncated;
+        }
         if (!(td <= 1 && ta <= 1)) {
-            throw std::runtime_error("Bad TD and TA in ReadSOS");
+            return DecodeStatus::kBadScanHeader;
         }
         if (!frame_pars.count(comp_num)) {
-            throw std::runtime_error("No component in frames in ReadSOS");
+            return DecodeStatus::kBadScanHeader;
         }
         frame_pars[comp_num].dc_huff_dest = td;
         frame_pars[comp_num].ac_huff_dest = ta;
     }
-    if (reader.GetByte() != 0) {  // Ss
-        throw std::runtime_error("Bad Ss in ReadSOS");
-    }
-    if (reader.GetByte() != 63) {  // Se
-        throw std::runtime_error("Bad Se in ReadSOS");
-    }
-    if (reader.GetByte() != 0) {  // Ah|Al
-        throw std::runtime_error("Bad Ah|Al in ReadSOS");
-    }
+    uint8_t start = reader.GetByte();  // Ss
+    uint8_t end = reader.GetByte();    // Se
+    uint8_t approx = reader.GetByte();  // Ah|Al
     size -= 3;
-    if (size != 0) {
-        throw std::runtime_error("Bad size in ReadSOS");
+    if (reader.Failed()) {
+        return DecodeStatus::kTruncated;
+    }
+    if (start != 0 || end != 63 || approx != 0 || size != 0) {
+        return DecodeStatus::kBadScanHeader;
     }
+    return DecodeStatus::kOk;
 }
 
-void ReadAPPn(BitReader &reader) {
+DecodeStatus ReadAPPn(BitReader &reader) {
     uint16_t size = reader.GetDoubleByte() - 2;
-    for (size_t id = 0; id < size; ++id) {
+    for (size_t id = 0; id < size && !reader.Failed(); ++id) {
         reader.GetByte();
     }
+    return reader.Failed() ? DecodeStatus::kTruncated : DecodeStatus::kOk;
 }
 
-void ReadDRI(BitReader &reader) {
-    uint16_t size = reader.GetDoubleByte() - 2;          // NOLINT
-    uint16_t restart_interval = reader.GetDoubleByte();  // NOLINT
-    assert(0);
+DecodeStatus ReadDRI(BitReader &reader, size_t &restart_interval) {
+    uint16_t size = reader.GetDoubleByte() - 2;
+    restart_interval = reader.GetDoubleByte();
+    if (reader.Failed()) {
+        return DecodeStatus::kTruncated;
+    }
+    return size == 2 ? DecodeStatus::kOk : DecodeStatus::kBadRestart;
 }
 
-void ReadRSTn(BitReader &reader) {  // NOLINT
-    assert(0);
+// |file_size|, when given, gets the number of file bytes up to and including EOI.
+// Collects the scan up to EOI. On failure |scan| still gets the data up to the
+// bad marker or the end of the stream.
+DecodeStatus ReadScanData(BitReader &reader, ScanData &scan, size_t *file_size = nullptr) {
+    ScanDataCollector collector;
+    std::vector<uint8_t> chunk(1 << 16);
+    size_t consumed = 0;
+    while (!collector.Finished() && !collector.Failed()) {
+        size_t cnt = reader.ReadChunk(chunk.data(), chunk.size());
+        if (cnt == 0) {
+            break;
+        }
+        consumed += collector.Feed(chunk.data(), cnt);
+    }
+    if (file_size != nullptr) {
+        *file_size = consumed;
+    }
+    scan = collector.Release();
+    if (collector.Failed()) {
+        return DecodeStatus::kBadScanData;
+    }
+    if (!collector.Finished()) {
+        return DecodeStatus::kTruncated;
+    }
+    return DecodeStatus::kOk;
 }
 
-std::string ReadCOM(BitReader &reader) {
+DecodeStatus ReadCOM(BitReader &reader, std::string &comment) {
     uint16_t size = reader.GetDoubleByte() - 2;
-    std::string comment;
-    for (size_t id = 0; id < size; ++id) {
+    comment.clear();
+    for (size_t id = 0; id < size && !reader.Failed(); ++id) {
         comment += static_cast<char>(reader.GetByte());
     }
-    return comment;
-}
\ No newline at end of file
+    return reader.Failed() ? DecodeStatus::kTruncated : DecodeStatus::kOk;
+}
@@ -0,0 +1,116 @@
+#include <mcu_index.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+const char kMagic[4] = {'J', 'M', 'C', 'I'};
+const uint8_t kVersion = 2;
+
+void WriteVarint(std::ostream &output, uint64_t value) {
+    while (value >= 0x80) {
+        output.put(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    output.put(static_cast<char>(value));
+}
+
+uint64_t ReadVarint(std::istream &input) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = input.get();
+        if (byte == std::istream::traits_type::eof()) {
+            throw std::runtime_error("EOF in ReadMcuIndex");
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Bad varint in ReadMcuIndex");
+}
+
+void WriteSigned(std::ostream &output, int64_t value) {
+    WriteVarint(output, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+int64_t ReadSigned(std::istream &input) {
+    uint64_t value = ReadVarint(input);
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+}  // namespace
+
+// Positions are stored as deltas and DC predictors as deltas from the previous
+// entry, both are small for neighbouring entries.
+void WriteMcuIndex(const McuIndex &index, std::ostream &output) {
+    output.write(kMagic, sizeof(kMagic));
+    output.put(static_cast<char>(kVersion));
+    output.put(static_cast<char>(index.component_count));
+    WriteVarint(output, index.source_size);
+    WriteVarint(output, index.source_hash);
+    WriteVarint(output, index.mcu_interval);
+    WriteVarint(output, index.mcu_count);
+    WriteVarint(output, index.scan_end);
+    WriteVarint(output, index.entries.size());
+    McuIndexEntry prev{0, {0, 0, 0}};
+    for (const auto &entry : index.entries) {
+        WriteVarint(output, entry.file_bit_pos - prev.file_bit_pos);
+        for (size_t comp = 0; comp < index.component_count; ++comp) {
+            WriteSigned(output, static_cast<int64_t>(entry.pref_sum_dc[comp]) -
+                                    prev.pref_sum_dc[comp]);
+        }
+        prev = entry;
+    }
+    if (!output) {
+        throw std::runtime_error("Can't write mcu index");
+    }
+}
+
+McuIndex ReadMcuIndex(std::istream &input, uint64_t source_hash, uint64_t source_size) {
+    char magic[sizeof(kMagic)];
+    if (!input.read(magic, sizeof(magic)) || std::string(magic, sizeof(magic)) !=
+                                                 std::string(kMagic, sizeof(kMagic))) {
+        throw std::runtime_error("Bad magic in ReadMcuIndex");
+    }
+    if (input.get() != kVersion) {
+        throw std::runtime_error("Bad version in ReadMcuIndex");
+    }
+    McuIndex index;
+    index.component_count = input.get();
+    if (index.component_count < 1 || index.component_count > 3) {
+        throw std::runtime_error("Bad component count in ReadMcuIndex");
+    }
+    index.source_size = ReadVarint(input);
+    index.source_hash = ReadVarint(input);
+    if (index.source_size != source_size || index.source_hash != source_hash) {
+        throw std::runtime_error("Index of another jpeg in ReadMcuIndex");
+    }
+    index.mcu_interval = ReadVarint(input);
+    index.mcu_count = ReadVarint(input);
+    index.scan_end = ReadVarint(input);
+    uint64_t size = ReadVarint(input);
+    if (index.mcu_interval == 0 || index.mcu_count == 0 || index.scan_end + 2 > source_size ||
+        size != (index.mcu_count - 1) / index.mcu_interval + 1) {
+        throw std::runtime_error("Bad entry count in ReadMcuIndex");
+    }
+    // No reserve: |size| comes from the file, every entry takes at least a byte
+    // of it, so a bogus count runs into EOF instead of a huge allocation.
+    McuIndexEntry prev{0, {0, 0, 0}};
+    for (uint64_t id = 0; id < size; ++id) {
+        uint64_t delta = ReadVarint(input);
+        // Every MCU takes at least one bit, entries strictly increase.
+        if ((id != 0 && delta == 0) || delta >= 8 * index.scan_end - prev.file_bit_pos) {
+            throw std::runtime_error("Bad entry position in ReadMcuIndex");
+        }
+        McuIndexEntry entry{prev.file_bit_pos + delta, {0, 0, 0}};
+        for (size_t comp = 0; comp < index.component_count; ++comp) {
+            entry.pref_sum_dc[comp] =
+                static_cast<int32_t>(prev.pref_sum_dc[comp] + ReadSigned(input));
+        }
+        index.entries.push_back(entry);
+        prev = entry;
+    }
+    return index;
+}
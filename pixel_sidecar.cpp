@@ -0,0 +1,273 @@
+#include <pixel_sidecar.h>
+
+#include <content_hash.h>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <fstream>
+#include <istream>
+#include <iterator>
+#include <streambuf>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace {
+
+const char kMagic[8] = {'J', 'P', 'E', 'G', 'R', 'A', 'W', '\n'};
+const size_t kHeaderSize = 64;
+
+void Store32(uint8_t *dst, uint32_t value) {
+    for (int id = 0; id < 4; ++id) {
+        dst[id] = static_cast<uint8_t>(value >> (8 * id));
+    }
+}
+
+void Store64(uint8_t *dst, uint64_t value) {
+    for (int id = 0; id < 8; ++id) {
+        dst[id] = static_cast<uint8_t>(value >> (8 * id));
+    }
+}
+
+uint32_t Load32(const uint8_t *src) {
+    uint32_t value = 0;
+    for (int id = 3; id >= 0; --id) {
+        value = (value << 8) | src[id];
+    }
+    return value;
+}
+
+uint64_t Load64(const uint8_t *src) {
+    uint64_t value = 0;
+    for (int id = 7; id >= 0; --id) {
+        value = (value << 8) | src[id];
+    }
+    return value;
+}
+
+size_t AlignedStride(size_t width, PixelFormat format) {
+    size_t row = width * BytesPerPixel(format);
+    return (row + kSidecarAlignment - 1) / kSidecarAlignment * kSidecarAlignment;
+}
+
+bool WriteFully(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t cnt = write(fd, data, size);
+        if (cnt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (cnt <= 0) {
+            return false;
+        }
+        data += cnt;
+        size -= cnt;
+    }
+    return true;
+}
+
+// Writes the header and rows produced by fill_row(y, row), which gets a
+// zeroed buffer of the padded stride.
+template <class F>
+SidecarStatus WriteRows(const std::string &path, PixelFormat format, size_t width, size_t height,
+                        uint64_t source_hash, size_t source_size, F fill_row) {
+    size_t stride = AlignedStride(width, format);
+    uint8_t header[kHeaderSize] = {};
+    std::copy(std::begin(kMagic), std::end(kMagic), header);
+    Store32(header + 8, kSidecarVersion);
+    Store32(header + 12, static_cast<uint32_t>(format));
+    Store64(header + 16, width);
+    Store64(header + 24, height);
+    Store64(header + 32, stride);
+    Store64(header + 40, source_hash);
+    Store64(header + 48, source_size);
+    Store64(header + 56, kHeaderSize);
+
+    // A unique name per call, writers of the same sidecar never share a file.
+    std::string tmp_path = path + ".tmp.XXXXXX";
+    int fd = mkostemp(tmp_path.data(), O_CLOEXEC);
+    if (fd < 0) {
+        return SidecarStatus::kIoError;
+    }
+    if (fchmod(fd, 0644) != 0) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return SidecarStatus::kIoError;
+    }
+    bool ok = WriteFully(fd, header, kHeaderSize);
+    std::vector<uint8_t> row(stride);
+    for (size_t y = 0; ok && y < height; ++y) {
+        std::fill(row.begin(), row.end(), 0);
+        fill_row(y, row.data());
+        ok = WriteFully(fd, row.data(), stride);
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return SidecarStatus::kIoError;
+    }
+    return SidecarStatus::kOk;
+}
+
+// Read-only stream over bytes owned by the caller.
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const uint8_t *data, size_t size) {
+        auto *begin = reinterpret_cast<char *>(const_cast<uint8_t *>(data));
+        setg(begin, begin, begin + size);
+    }
+};
+
+}  // namespace
+
+size_t BytesPerPixel(PixelFormat format) {
+    return format == PixelFormat::kRgb8 ? 3 : 1;
+}
+
+SidecarStatus WriteSidecar(const std::string &path, const PixelView &pixels, uint64_t source_hash,
+                           size_t source_size) {
+    size_t row_bytes = pixels.width * BytesPerPixel(pixels.format);
+    return WriteRows(path, pixels.format, pixels.width, pixels.height, source_hash, source_size,
+                     [&](size_t y, uint8_t *row) {
+                         std::copy(pixels.Row(y), pixels.Row(y) + row_bytes, row);
+                     });
+}
+
+SidecarStatus WriteSidecar(const std::string &path, const Image &image, uint64_t source_hash,
+                           size_t source_size) {
+    return WriteRows(path, PixelFormat::kRgb8, image.Width(), image.Height(), source_hash,
+                     source_size, [&](size_t y, uint8_t *row) {
+                         for (size_t x = 0; x < image.Width(); ++x) {
+                             RGB pixel = image.GetPixel(y, x);
+                             row[3 * x] = static_cast<uint8_t>(pixel.r);
+                             row[3 * x + 1] = static_cast<uint8_t>(pixel.g);
+                             row[3 * x + 2] = static_cast<uint8_t>(pixel.b);
+                         }
+                     });
+}
+
+SidecarStatus WriteSidecar(const std::string &path, const GrayImage &image, uint64_t source_hash,
+                           size_t source_size) {
+    PixelView view{PixelFormat::kGray8, image.width, image.height, image.width,
+                   image.pixels.data()};
+    return WriteSidecar(path, view, source_hash, source_size);
+}
+
+PixelSidecar::~PixelSidecar() {
+    Close();
+}
+
+PixelSidecar::PixelSidecar(PixelSidecar &&other) noexcept
+    : map_(std::exchange(other.map_, nullptr)),
+      map_size_(std::exchange(other.map_size_, 0)),
+      view_(std::exchange(other.view_, PixelView())) {
+}
+
+PixelSidecar &PixelSidecar::operator=(PixelSidecar &&other) noexcept {
+    if (this != &other) {
+        Close();
+        map_ = std::exchange(other.map_, nullptr);
+        map_size_ = std::exchange(other.map_size_, 0);
+        view_ = std::exchange(other.view_, PixelView());
+    }
+    return *this;
+}
+
+void PixelSidecar::Close() {
+    if (map_ != nullptr) {
+        munmap(map_, map_size_);
+    }
+    map_ = nullptr;
+    map_size_ = 0;
+    view_ = PixelView();
+}
+
+SidecarStatus PixelSidecar::Open(const std::string &path, uint64_t source_hash,
+                                 size_t source_size) {
+    Close();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return SidecarStatus::kIoError;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return SidecarStatus::kIoError;
+    }
+    size_t file_size = info.st_size;
+    if (file_size < kHeaderSize) {
+        close(fd);
+        return SidecarStatus::kBadFormat;
+    }
+    void *map = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return SidecarStatus::kIoError;
+    }
+    map_ = map;
+    map_size_ = file_size;
+
+    const auto *header = static_cast<const uint8_t *>(map);
+    auto format = static_cast<PixelFormat>(Load32(header + 12));
+    uint64_t width = Load64(header + 16);
+    uint64_t height = Load64(header + 24);
+    uint64_t stride = Load64(header + 32);
+    uint64_t offset = Load64(header + 56);
+    bool valid = std::equal(std::begin(kMagic), std::end(kMagic), header) &&
+                 Load32(header + 8) == kSidecarVersion &&
+                 (format == PixelFormat::kRgb8 || format == PixelFormat::kGray8) &&
+                 offset % kSidecarAlignment == 0 && offset >= kHeaderSize &&
+                 offset <= file_size && stride % kSidecarAlignment == 0 &&
+                 width <= stride / BytesPerPixel(format) &&
+                 (stride == 0 || height <= (file_size - offset) / stride) &&
+                 (width == 0 || height == 0 || stride != 0);
+    if (!valid) {
+        Close();
+        return SidecarStatus::kBadFormat;
+    }
+    if (Load64(header + 40) != source_hash || Load64(header + 48) != source_size) {
+        Close();
+        return SidecarStatus::kStale;
+    }
+    view_ = {format, width, height, stride, header + offset};
+    return SidecarStatus::kOk;
+}
+
+DecodeStatus DecodeFileWithSidecar(const std::string &jpeg_path, const std::string &sidecar_path,
+                                   PixelFormat format, PixelSidecar &sidecar) {
+    std::ifstream file(jpeg_path, std::ios::binary | std::ios::ate);
+    std::vector<uint8_t> data(file.is_open() ? static_cast<size_t>(file.tellg()) : 0);
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(data.data()), data.size())) {
+        return DecodeStatus::kIoError;
+    }
+    uint64_t hash = HashBytes(data.data(), data.size());
+    if (sidecar.Open(sidecar_path, hash, data.size()) == SidecarStatus::kOk &&
+        sidecar.View().format == format) {
+        return DecodeStatus::kOk;
+    }
+
+    MemoryStreamBuf buffer(data.data(), data.size());
+    std::istream input(&buffer);
+    SidecarStatus written;
+    if (format == PixelFormat::kGray8) {
+        auto result = TryDecodeLuma(input);
+        if (!result.Ok()) {
+            return result.status;
+        }
+        written = WriteSidecar(sidecar_path, result.image, hash, data.size());
+    } else {
+        auto result = TryDecode(input);
+        if (!result.Ok()) {
+            return result.status;
+        }
+        written = WriteSidecar(sidecar_path, result.image, hash, data.size());
+    }
+    if (written != SidecarStatus::kOk ||
+        sidecar.Open(sidecar_path, hash, data.size()) != SidecarStatus::kOk) {
+        return DecodeStatus::kIoError;
+    }
+    return DecodeStatus::kOk;
+}
@@ -0,0 +1,246 @@
+#include "read_queue.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define JPEG_DECODER_HAS_IO_URING 1
+#endif
+
+namespace {
+
+// Reads until |size| bytes, EOF or an error.
+ssize_t PreadFully(const ReadRequest &request) {
+    size_t done = 0;
+    while (done < request.size) {
+        ssize_t cnt = pread(request.fd, request.data + done, request.size - done,
+                            static_cast<off_t>(request.offset + done));
+        if (cnt < 0 && errno == EINTR) {
+            continue;
+        }
+        if (cnt < 0) {
+            return -errno;
+        }
+        if (cnt == 0) {
+            break;
+        }
+        done += cnt;
+    }
+    return static_cast<ssize_t>(done);
+}
+
+class PreadQueue : public ReadQueue {
+public:
+    void Submit(const ReadRequest &request) override {
+        pending_.push_back(request);
+    }
+
+    void Wait(std::vector<ReadCompletion> &completions) override {
+        if (pending_.empty()) {
+            return;
+        }
+        auto request = pending_.front();
+        pending_.pop_front();
+        completions.push_back({request.tag, PreadFully(request)});
+    }
+
+    bool UsesIoUring() const override {
+        return false;
+    }
+
+private:
+    std::deque<ReadRequest> pending_;
+};
+
+#ifdef JPEG_DECODER_HAS_IO_URING
+
+// Minimal io_uring client on raw syscalls: one submission and one completion
+// ring, READV requests, no SQ polling.
+class IoUringQueue : public ReadQueue {
+public:
+    IoUringQueue(int ring_fd, size_t capacity)
+        : ring_fd_(ring_fd), requests_(capacity), iovecs_(capacity), in_flight_(capacity, false) {
+    }
+
+    ~IoUringQueue() override {
+        if (sq_ring_ != MAP_FAILED && sq_ring_ != nullptr) {
+            munmap(sq_ring_, sq_ring_size_);
+        }
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sqes_ != MAP_FAILED && sqes_ != nullptr) {
+            munmap(sqes_, sqes_size_);
+        }
+        close(ring_fd_);
+    }
+
+    bool Map(const io_uring_params &params) {
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            return false;
+        }
+        cq_ring_ = single_mmap ? sq_ring_
+                               : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ring_ == MAP_FAILED) {
+            return false;
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) {
+            return false;
+        }
+
+        auto *sq = static_cast<uint8_t *>(sq_ring_);
+        sq_head_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+        auto *cq = static_cast<uint8_t *>(cq_ring_);
+        cq_head_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void Submit(const ReadRequest &request) override {
+        uint32_t tail = *sq_tail_;
+        uint32_t index = tail & sq_mask_;
+        // The kernel may read the iovec after the entry is consumed, so it
+        // lives with the tag until completion.
+        iovecs_[request.tag] = {request.data, request.size};
+        in_flight_[request.tag] = true;
+        auto &sqe = static_cast<io_uring_sqe *>(sqes_)[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READV;
+        sqe.fd = request.fd;
+        sqe.off = request.offset;
+        sqe.addr = reinterpret_cast<uint64_t>(&iovecs_[request.tag]);
+        sqe.len = 1;
+        sqe.user_data = request.tag;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit_;
+        requests_[request.tag] = request;
+    }
+
+    void Wait(std::vector<ReadCompletion> &completions) override {
+        size_t before = completions.size();
+        while (completions.size() == before) {
+            long ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, 1u,
+                               IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+                Reap(completions);
+                continue;
+            }
+            if (ret < 0) {
+                FailInFlight(-errno, completions);
+                return;
+            }
+            to_submit_ -= static_cast<uint32_t>(ret);
+            Reap(completions);
+        }
+    }
+
+    bool UsesIoUring() const override {
+        return true;
+    }
+
+private:
+    void Reap(std::vector<ReadCompletion> &completions) {
+        uint32_t head = *cq_head_;
+        uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            const auto &cqe = cqes_[head & cq_mask_];
+            size_t tag = cqe.user_data;
+            ssize_t result = cqe.res;
+            if (result >= 0 && static_cast<size_t>(result) < requests_[tag].size) {
+                // Short read inside the file, finish it synchronously.
+                ReadRequest rest = requests_[tag];
+                rest.offset += result;
+                rest.data += result;
+                rest.size -= result;
+                ssize_t more = PreadFully(rest);
+                result = more < 0 ? more : result + more;
+            }
+            in_flight_[tag] = false;
+            completions.push_back({tag, result});
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    // The ring is unusable, so every read in flight is reported as failed.
+    void FailInFlight(ssize_t error, std::vector<ReadCompletion> &completions) {
+        for (size_t tag = 0; tag < in_flight_.size(); ++tag) {
+            if (in_flight_[tag]) {
+                in_flight_[tag] = false;
+                completions.push_back({tag, error});
+            }
+        }
+        to_submit_ = 0;
+    }
+
+    int ring_fd_;
+    void *sq_ring_ = nullptr;
+    void *cq_ring_ = nullptr;
+    void *sqes_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    size_t sqes_size_ = 0;
+    uint32_t *sq_head_ = nullptr;
+    uint32_t *sq_tail_ = nullptr;
+    uint32_t sq_mask_ = 0;
+    uint32_t *sq_array_ = nullptr;
+    uint32_t *cq_head_ = nullptr;
+    uint32_t *cq_tail_ = nullptr;
+    uint32_t cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+    uint32_t to_submit_ = 0;
+    std::vector<ReadRequest> requests_;
+    std::vector<iovec> iovecs_;
+    std::vector<bool> in_flight_;
+};
+
+#endif
+
+}  // namespace
+
+std::unique_ptr<ReadQueue> MakeIoUringQueue(size_t capacity) {
+#ifdef JPEG_DECODER_HAS_IO_URING
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    long ring_fd = syscall(__NR_io_uring_setup, static_cast<unsigned>(capacity), &params);
+    if (ring_fd < 0) {
+        return nullptr;
+    }
+    auto queue = std::make_unique<IoUringQueue>(static_cast<int>(ring_fd), capacity);
+    if (!queue->Map(params) || params.sq_entries < capacity) {
+        return nullptr;
+    }
+    return queue;
+#else
+    (void)capacity;
+    return nullptr;
+#endif
+}
+
+std::unique_ptr<ReadQueue> MakePreadQueue() {
+    return std::make_unique<PreadQueue>();
+}
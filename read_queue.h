@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct ReadRequest {
+    int fd;
+    uint64_t offset;
+    uint8_t *data;
+    size_t size;
+    // Below the queue capacity and unique among requests in flight.
+    size_t tag;
+};
+
+struct ReadCompletion {
+    size_t tag;
+    // Bytes read or -errno.
+    ssize_t result;
+};
+
+// Queue of file reads owned by a single thread.
+class ReadQueue {
+public:
+    virtual ~ReadQueue() = default;
+
+    // Queues a read, at most capacity reads may be in flight.
+    virtual void Submit(const ReadRequest &request) = 0;
+
+    // Starts the queued reads and blocks until at least one of them completes,
+    // some read must be in flight. Completions are appended to |completions|.
+    virtual void Wait(std::vector<ReadCompletion> &completions) = 0;
+
+    virtual bool UsesIoUring() const = 0;
+};
+
+// io_uring queue with |capacity| entries, or null when the kernel does not
+// provide io_uring.
+std::unique_ptr<ReadQueue> MakeIoUringQueue(size_t capacity);
+
+// Queue doing blocking preads on the calling thread inside Wait().
+std::unique_ptr<ReadQueue> MakePreadQueue();
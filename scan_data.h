@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// Entropy-coded segment of a scan with byte stuffing and RSTn markers removed.
+struct ScanData {
+    std::vector<uint8_t> bytes;
+    // Pairs of (position in |bytes|, offset from the scan start in the file)
+    // recorded after every dropped run of bytes.
+    std::vector<std::pair<size_t, size_t>> file_offsets;
+    // Positions in |bytes| where a restart interval begins, the first one is 0.
+    std::vector<size_t> restarts;
+};
+
+// Splits incoming chunks of the file into ScanData until EOI is met.
+class ScanDataCollector {
+public:
+    ScanDataCollector() : consumed_(0), after_ff_(false), finished_(false), failed_(false) {
+        scan_.restarts.push_back(0);
+        scan_.file_offsets.emplace_back(0, 0);
+    }
+
+    // Returns the number of consumed bytes, it is less than |size| only after
+    // EOI or a bad marker.
+    size_t Feed(const uint8_t *data, size_t size) {
+        size_t pos = 0;
+        while (pos < size && !finished_ && !failed_) {
+            if (!after_ff_) {
+                auto ff = static_cast<const uint8_t *>(std::memchr(data + pos, 0xff, size - pos));
+                size_t end = ff ? ff - data : size;
+                scan_.bytes.insert(scan_.bytes.end(), data + pos, data + end);
+                pos = ff ? end + 1 : end;
+                after_ff_ = ff != nullptr;
+                continue;
+            }
+            uint8_t byte = data[pos++];
+            if (byte == 0xff) {  // Fill byte
+                continue;
+            }
+            after_ff_ = false;
+            if (byte == 0) {
+                scan_.bytes.push_back(0xff);
+                scan_.file_offsets.emplace_back(scan_.bytes.size(), consumed_ + pos);
+            } else if (0xd0 <= byte && byte <= 0xd7) {
+                scan_.restarts.push_back(scan_.bytes.size());
+                scan_.file_offsets.emplace_back(scan_.bytes.size(), consumed_ + pos);
+            } else if (byte == 0xd9) {
+                finished_ = true;
+            } else {
+                failed_ = true;
+            }
+        }
+        consumed_ += pos;
+        return pos;
+    }
+
+    bool Finished() const {
+        return finished_;
+    }
+
+    // A marker other than RSTn or EOI was met inside the scan.
+    bool Failed() const {
+        return failed_;
+    }
+
+    ScanData Release() {
+        return std::move(scan_);
+    }
+
+private:
+    ScanData scan_;
+    size_t consumed_;
+    bool after_ff_;
+    bool finished_;
+    bool failed_;
+};
+
+// Offset from the scan start in the file of the byte |pos| of |scan.bytes|.
+inline size_t ScanFileOffset(const ScanData &scan, size_t pos) {
+    auto it = std::upper_bound(scan.file_offsets.begin(), scan.file_offsets.end(),
+                               std::make_pair(pos, SIZE_MAX));
+    --it;
+    return it->second + (pos - it->first);
+}
@@ -0,0 +1,430 @@
+#include "scan_decoder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+
+namespace {
+
+// Blocks decoded from a guessed position: the first block is assumed to be
+// slot 0 of some MCU. Only the part after synchronisation with the true
+// stream is used.
+struct SpeculativeRun {
+    std::vector<size_t> starts;
+    std::vector<size_t> slots;
+    std::vector<CoefBlock> blocks;
+    size_t end_pos = 0;
+};
+
+// Threads shared by all scans, so decoding many small images does not create
+// threads per image.
+class WorkerPool {
+public:
+    static WorkerPool &Instance() {
+        static WorkerPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+        return pool;
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_t Size() const {
+        return workers_.size();
+    }
+
+    void Submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        wake_.notify_one();
+    }
+
+private:
+    explicit WorkerPool(size_t size) : stop_(false) {
+        for (size_t id = 0; id < size; ++id) {
+            try {
+                workers_.emplace_back([this] { Loop(); });
+            } catch (const std::system_error &) {
+                // Out of threads, callers do the rest of the work themselves.
+                break;
+            }
+        }
+    }
+
+    void Loop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::function<void()>> tasks_;
+    bool stop_;
+    std::vector<std::thread> workers_;
+};
+
+// Runs func(0), ..., func(cnt - 1) concurrently and returns the first failure.
+// Tasks are claimed through a counter by the calling thread and the pool
+// workers alike, so the caller never waits for a task nobody has started.
+template <class F>
+DecodeStatus RunParallel(size_t cnt, F func) {
+    std::vector<DecodeStatus> statuses(cnt, DecodeStatus::kOk);
+    struct Job {
+        std::atomic<size_t> next{0};
+        size_t done = 0;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    // Helpers may be dequeued after the call returned, they only touch |job|
+    // then, as every task is already claimed.
+    auto job = std::make_shared<Job>();
+    auto work = [job, cnt, &func, &statuses] {
+        for (size_t id; (id = job->next.fetch_add(1)) < cnt;) {
+            // Same mapping as TryDecode, an escaping exception would leave the
+            // job unfinished.
+            try {
+                statuses[id] = func(id);
+            } catch (const std::bad_alloc &) {
+                statuses[id] = DecodeStatus::kOutOfMemory;
+            } catch (...) {
+                statuses[id] = DecodeStatus::kIoError;
+            }
+            std::lock_guard<std::mutex> lock(job->mutex);
+            if (++job->done == cnt) {
+                job->finished.notify_all();
+            }
+        }
+    };
+    auto &pool = WorkerPool::Instance();
+    for (size_t id = 1; id < std::min(cnt, pool.Size() + 1); ++id) {
+        pool.Submit(work);
+    }
+    work();
+    {
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&] { return job->done == cnt; });
+    }
+    for (auto status : statuses) {
+        if (status != DecodeStatus::kOk) {
+            return status;
+        }
+    }
+    return DecodeStatus::kOk;
+}
+
+// Checks |control| whenever |block| starts an MCU row.
+DecodeStatus CheckRow(const ScanLayout &layout, const DecodeControl *control, size_t block) {
+    if (control == nullptr || block % (layout.mcus_per_row * layout.slot_component.size()) != 0) {
+        return DecodeStatus::kOk;
+    }
+    return control->Check();
+}
+
+bool DecodeSlot(ScanBitReader &reader, const ScanLayout &layout, size_t slot, CoefBlock &block) {
+    size_t comp = layout.slot_component[slot];
+    if (comp != 0 && layout.luma_only) {
+        int dc_diff = 0;
+        block.coef[0] = 0;
+        return SkipBlock(reader, *layout.dc_tables[comp], *layout.ac_tables[comp], dc_diff);
+    }
+    return DecodeBlock(reader, *layout.dc_tables[comp], *layout.ac_tables[comp],
+                       layout.quant[comp].data(), block);
+}
+
+// Stops early when |control| says so, the stitching then notices it too. A
+// block that fails past |end| ends the run: it can only be the padding after
+// the last block or a false trace, which the stitching never adopts anyway.
+SpeculativeRun DecodeSpeculatively(const ScanData &scan, const ScanLayout &layout, size_t begin,
+                                   size_t end, const DecodeControl *control) {
+    size_t blocks_per_mcu = layout.slot_component.size();
+    SpeculativeRun run;
+    ScanBitReader reader(scan.bytes.data(), scan.bytes.size(), begin);
+    CoefBlock block;
+    size_t slot = 0;
+    size_t decoded = 0;
+    while (reader.GetCurPos() < end) {
+        size_t start = reader.GetCurPos();
+        if (!DecodeSlot(reader, layout, slot, block)) {
+            if (reader.GetCurPos() >= end || reader.Overrun()) {
+                run.end_pos = start;
+                return run;
+            }
+            // Everything decoded so far was a false trace, retry one bit later.
+            run.starts.clear();
+            run.slots.clear();
+            run.blocks.clear();
+            reader = ScanBitReader(scan.bytes.data(), scan.bytes.size(), start + 1);
+            slot = 0;
+            continue;
+        }
+        run.starts.push_back(start);
+        run.slots.push_back(slot);
+        run.blocks.push_back(block);
+        slot = (slot + 1) % blocks_per_mcu;
+        if (CheckRow(layout, control, ++decoded) != DecodeStatus::kOk) {
+            break;
+        }
+    }
+    run.end_pos = reader.GetCurPos();
+    return run;
+}
+
+DecodeStatus DecodeIntervals(const ScanData &scan, const ScanLayout &layout, size_t threads,
+                             ScanCoefficients &result, const DecodeControl *control) {
+    size_t blocks_per_mcu = layout.slot_component.size();
+    size_t intervals = (layout.mcu_count + layout.restart_interval - 1) / layout.restart_interval;
+    if (scan.restarts.size() != intervals) {
+        return DecodeStatus::kBadRestart;
+    }
+    size_t workers = std::max<size_t>(1, std::min(threads, intervals));
+    return RunParallel(workers, [&](size_t worker) {
+        for (size_t id = intervals * worker / workers; id < intervals * (worker + 1) / workers;
+             ++id) {
+            size_t first = id * layout.restart_interval * blocks_per_mcu;
+            size_t last = std::min(layout.mcu_count, (id + 1) * layout.restart_interval) *
+                          blocks_per_mcu;
+            ScanBitReader reader(scan.bytes.data(), scan.bytes.size(), 8 * scan.restarts[id]);
+            for (size_t block = first; block < last; ++block) {
+                auto status = CheckRow(layout, control, block);
+                if (status != DecodeStatus::kOk) {
+                    return status;
+                }
+                if (!DecodeSlot(reader, layout, block % blocks_per_mcu, result.blocks[block])) {
+                    return DecodeStatus::kBadScanData;
+                }
+            }
+        }
+        return DecodeStatus::kOk;
+    });
+}
+
+DecodeStatus DecodeChunks(const ScanData &scan, const ScanLayout &layout, size_t threads,
+                          ScanCoefficients &result, const DecodeControl *control) {
+    size_t blocks_per_mcu = layout.slot_component.size();
+    size_t total = layout.mcu_count * blocks_per_mcu;
+    size_t chunks = std::max<size_t>(1, std::min(threads, scan.bytes.size() / kMinChunkBytes));
+    std::vector<size_t> bounds(chunks + 1);
+    for (size_t id = 0; id <= chunks; ++id) {
+        bounds[id] = 8 * scan.bytes.size() * id / chunks;
+    }
+
+    // Chunk 0 starts at a known position and is decoded for real, the rest are guessed.
+    std::vector<SpeculativeRun> runs(chunks);
+    ScanBitReader reader(scan.bytes.data(), scan.bytes.size());
+    size_t block = 0;
+    auto status = RunParallel(chunks, [&](size_t id) {
+        if (id != 0) {
+            runs[id] = DecodeSpeculatively(scan, layout, bounds[id], bounds[id + 1], control);
+            return DecodeStatus::kOk;
+        }
+        for (; block < total && reader.GetCurPos() < bounds[1]; ++block) {
+            auto status = CheckRow(layout, control, block);
+            if (status != DecodeStatus::kOk) {
+                return status;
+            }
+            if (!DecodeSlot(reader, layout, block % blocks_per_mcu, result.blocks[block])) {
+                return DecodeStatus::kBadScanData;
+            }
+        }
+        return DecodeStatus::kOk;
+    });
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+
+    // Walk the true stream through every chunk until it meets a block start with
+    // the same slot, from there on the speculative result is exact.
+    for (size_t id = 1; id < chunks && block < total; ++id) {
+        const auto &run = runs[id];
+        size_t pos = 0;
+        while (block < total) {
+            size_t cur = reader.GetCurPos();
+            while (pos < run.starts.size() && run.starts[pos] < cur) {
+                ++pos;
+            }
+            if (pos < run.starts.size() && run.starts[pos] == cur &&
+                run.slots[pos] == block % blocks_per_mcu) {
+                size_t cnt = std::min(run.starts.size() - pos, total - block);
+                std::copy(run.blocks.begin() + pos, run.blocks.begin() + pos + cnt,
+                          result.blocks.begin() + block);
+                block += cnt;
+                size_t next = pos + cnt < run.starts.size() ? run.starts[pos + cnt] : run.end_pos;
+                reader = ScanBitReader(scan.bytes.data(), scan.bytes.size(), next);
+                break;
+            }
+            if (cur >= bounds[id + 1]) {
+                break;
+            }
+            status = CheckRow(layout, control, block);
+            if (status != DecodeStatus::kOk) {
+                return status;
+            }
+            if (!DecodeSlot(reader, layout, block % blocks_per_mcu, result.blocks[block])) {
+                return DecodeStatus::kBadScanData;
+            }
+            ++block;
+        }
+    }
+    for (; block < total; ++block) {
+        status = CheckRow(layout, control, block);
+        if (status != DecodeStatus::kOk) {
+            return status;
+        }
+        if (!DecodeSlot(reader, layout, block % blocks_per_mcu, result.blocks[block])) {
+            return DecodeStatus::kBadScanData;
+        }
+    }
+    return DecodeStatus::kOk;
+}
+
+void AccumulateDc(const ScanLayout &layout, ScanCoefficients &result) {
+    size_t blocks_per_mcu = layout.slot_component.size();
+    std::vector<int> pref_sum_dc(layout.dc_tables.size());
+    for (size_t mcu = 0; mcu < layout.mcu_count; ++mcu) {
+        if (layout.restart_interval != 0 && mcu % layout.restart_interval == 0) {
+            std::fill(pref_sum_dc.begin(), pref_sum_dc.end(), 0);
+        }
+        for (size_t slot = 0; slot < blocks_per_mcu; ++slot) {
+            size_t comp = layout.slot_component[slot];
+            int16_t &dc = result.blocks[mcu * blocks_per_mcu + slot].coef[0];
+            pref_sum_dc[comp] += dc;
+            dc = SaturateCoef(pref_sum_dc[comp] * layout.quant[comp][0]);
+        }
+    }
+}
+
+}  // namespace
+
+DecodeStatus DecodeScan(const ScanData &scan, const ScanLayout &layout, size_t threads,
+                        ScanCoefficients &result, const DecodeControl *control) {
+    result.blocks.resize(layout.mcu_count * layout.slot_component.size());
+    DecodeStatus status;
+    if (layout.restart_interval != 0) {
+        status = DecodeIntervals(scan, layout, threads, result, control);
+    } else if (scan.restarts.size() > 1) {
+        status = DecodeStatus::kBadRestart;
+    } else {
+        status = DecodeChunks(scan, layout, threads, result, control);
+    }
+    if (status == DecodeStatus::kOk) {
+        AccumulateDc(layout, result);
+    }
+    return status;
+}
+
+DecodeStatus DecodeMcus(const ScanData &scan, const ScanLayout &layout, ScanCursor &cursor,
+                        size_t last_mcu, CoefBlock *blocks) {
+    size_t blocks_per_mcu = layout.slot_component.size();
+    cursor.pref_sum_dc.resize(layout.dc_tables.size());
+    ScanBitReader reader(scan.bytes.data(), scan.bytes.size(), cursor.bit_pos);
+    CoefBlock block;
+    for (; cursor.mcu < last_mcu; ++cursor.mcu) {
+        if (layout.restart_interval != 0 && cursor.mcu != 0 &&
+            cursor.mcu % layout.restart_interval == 0) {
+            // Every interval takes at least one byte, so the next one starts at
+            // the first restart position after the current byte.
+            auto next = std::lower_bound(scan.restarts.begin(), scan.restarts.end(),
+                                         (reader.GetCurPos() + 7) / 8);
+            if (next == scan.restarts.end()) {
+                return DecodeStatus::kBadRestart;
+            }
+            reader = ScanBitReader(scan.bytes.data(), scan.bytes.size(), 8 * *next);
+            std::fill(cursor.pref_sum_dc.begin(), cursor.pref_sum_dc.end(), 0);
+        }
+        for (size_t slot = 0; slot < blocks_per_mcu; ++slot) {
+            size_t comp = layout.slot_component[slot];
+            CoefBlock &dst = blocks ? *blocks++ : block;
+            if (!DecodeSlot(reader, layout, slot, dst)) {
+                return DecodeStatus::kBadScanData;
+            }
+            cursor.pref_sum_dc[comp] += dst.coef[0];
+            dst.coef[0] = SaturateCoef(cursor.pref_sum_dc[comp] * layout.quant[comp][0]);
+        }
+    }
+    cursor.bit_pos = reader.GetCurPos();
+    return DecodeStatus::kOk;
+}
+
+DecodeStatus CheckScan(const ScanData &scan, const ScanLayout &layout, size_t &valid_mcus,
+                       size_t &bit_pos) {
+    ScanBitReader reader(scan.bytes.data(), scan.bytes.size());
+    size_t interval = 0;
+    int dc_diff = 0;
+    for (valid_mcus = 0; valid_mcus < layout.mcu_count; ++valid_mcus) {
+        if (layout.restart_interval != 0 && valid_mcus != 0 &&
+            valid_mcus % layout.restart_interval == 0) {
+            ++interval;
+            if (interval >= scan.restarts.size() ||
+                (reader.GetCurPos() + 7) / 8 != scan.restarts[interval]) {
+                bit_pos = reader.GetCurPos();
+                return DecodeStatus::kBadRestart;
+            }
+            reader = ScanBitReader(scan.bytes.data(), scan.bytes.size(),
+                                   8 * scan.restarts[interval]);
+        }
+        bit_pos = reader.GetCurPos();
+        for (size_t comp : layout.slot_component) {
+            if (!SkipBlock(reader, *layout.dc_tables[comp], *layout.ac_tables[comp], dc_diff)) {
+                return DecodeStatus::kBadScanData;
+            }
+        }
+    }
+    bit_pos = reader.GetCurPos();
+    if (scan.restarts.size() != interval + 1) {
+        return DecodeStatus::kBadRestart;
+    }
+    return (bit_pos + 7) / 8 == scan.bytes.size() ? DecodeStatus::kOk
+                                                   : DecodeStatus::kBadScanData;
+}
+
+DecodeStatus DecodeDcValues(const ScanData &scan, const ScanLayout &layout, int16_t *dc) {
+    std::vector<int> pref_sum_dc(layout.dc_tables.size());
+    ScanBitReader reader(scan.bytes.data(), scan.bytes.size());
+    int dc_diff = 0;
+    for (size_t mcu = 0; mcu < layout.mcu_count; ++mcu) {
+        if (layout.restart_interval != 0 && mcu != 0 && mcu % layout.restart_interval == 0) {
+            auto next = std::lower_bound(scan.restarts.begin(), scan.restarts.end(),
+                                         (reader.GetCurPos() + 7) / 8);
+            if (next == scan.restarts.end()) {
+                return DecodeStatus::kBadRestart;
+            }
+            reader = ScanBitReader(scan.bytes.data(), scan.bytes.size(), 8 * *next);
+            std::fill(pref_sum_dc.begin(), pref_sum_dc.end(), 0);
+        }
+        for (size_t comp : layout.slot_component) {
+            if (!SkipBlock(reader, *layout.dc_tables[comp], *layout.ac_tables[comp], dc_diff)) {
+                return DecodeStatus::kBadScanData;
+            }
+            pref_sum_dc[comp] += dc_diff;
+            *dc++ = SaturateCoef(pref_sum_dc[comp] * layout.quant[comp][0]);
+        }
+    }
+    return DecodeStatus::kOk;
+}
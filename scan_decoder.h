@@ -0,0 +1,159 @@
+#pragma once
+
+#include <decode_result.h>
+#include <array>
+#include <cstddef>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "bitreader.h"
+#include "huffman_lookup.h"
+#include "scan_data.h"
+#include "structures.h"
+
+// Block structure of a baseline scan.
+struct ScanLayout {
+    // Component index of every block inside one MCU, in bitstream order.
+    std::vector<size_t> slot_component;
+    // DC and AC tables of each component.
+    std::vector<const HuffmanLookup *> dc_tables;
+    std::vector<const HuffmanLookup *> ac_tables;
+    // Quant table of each component in zigzag order.
+    std::vector<std::array<uint16_t, 64>> quant;
+    size_t mcu_count;
+    size_t mcus_per_row;
+    // MCUs per restart interval, 0 when the scan has no restart markers.
+    size_t restart_interval;
+    // Chroma blocks are only decoded far enough to advance the stream, their
+    // coefficients must not be used.
+    bool luma_only = false;
+};
+
+// State of the sequential decoder between two MCUs. A cursor taken right
+// before an interval start still points in front of its restart marker.
+struct ScanCursor {
+    size_t mcu = 0;
+    size_t bit_pos = 0;
+    std::vector<int> pref_sum_dc;
+};
+
+// Decoded blocks in bitstream order, DC values are already accumulated with
+// their predictors and dequantised.
+struct ScanCoefficients {
+    std::vector<CoefBlock> blocks;
+};
+
+// Dequantised values of broken streams may not fit, valid ones always do.
+inline int16_t SaturateCoef(int32_t val) {
+    return static_cast<int16_t>(std::min<int32_t>(INT16_MAX, std::max<int32_t>(INT16_MIN, val)));
+}
+
+// Decodes one block straight into natural order, dequantising AC values with
+// |quant| (zigzag order). coef[0] gets the raw DC difference.
+// Returns false when the bits are not a valid block.
+inline bool DecodeBlock(ScanBitReader &reader, const HuffmanLookup &dc, const HuffmanLookup &ac,
+                        const uint16_t *quant, CoefBlock &block) {
+    int16_t *coef = block.coef;
+    std::fill(coef, coef + 64, 0);
+    auto extend = [](int32_t val, int size) {
+        return val < (1 << (size - 1)) ? val - (1 << size) + 1 : val;
+    };
+    int size = dc.Decode(reader);
+    if (size < 0 || size > 11) {
+        return false;
+    }
+    if (size != 0) {
+        coef[0] = extend(reader.GetBits(size), size);
+    }
+    for (int pos = 1; pos < 64;) {
+        int value = ac.Decode(reader);
+        if (value < 0) {
+            return false;
+        }
+        int cnt_zeros = value >> 4;
+        size = value & 15;
+        if (size == 0) {
+            if (cnt_zeros != 15) {  // EOB
+                break;
+            }
+            pos += 16;  // ZRL
+            if (pos > 64) {
+                return false;
+            }
+            continue;
+        }
+        pos += cnt_zeros;
+        if (pos > 63) {
+            return false;
+        }
+        coef[kZigZagOrder[pos]] = SaturateCoef(extend(reader.GetBits(size), size) * quant[pos]);
+        ++pos;
+    }
+    return !reader.Overrun();
+}
+
+// Decodes one block without storing it, |dc_diff| gets the raw DC difference.
+// Accepts exactly the blocks DecodeBlock accepts.
+inline bool SkipBlock(ScanBitReader &reader, const HuffmanLookup &dc, const HuffmanLookup &ac,
+                      int &dc_diff) {
+    int size = dc.Decode(reader);
+    if (size < 0 || size > 11) {
+        return false;
+    }
+    dc_diff = 0;
+    if (size != 0) {
+        int32_t val = reader.GetBits(size);
+        dc_diff = val < (1 << (size - 1)) ? val - (1 << size) + 1 : val;
+    }
+    for (int pos = 1; pos < 64;) {
+        int value = ac.Decode(reader);
+        if (value < 0) {
+            return false;
+        }
+        size = value & 15;
+        if (size == 0) {
+            if ((value >> 4) != 15) {  // EOB
+                break;
+            }
+            pos += 16;  // ZRL
+            if (pos > 64) {
+                return false;
+            }
+            continue;
+        }
+        pos += value >> 4;
+        if (pos > 63) {
+            return false;
+        }
+        reader.SkipBits(size);
+        ++pos;
+    }
+    return !reader.Overrun();
+}
+
+// Scans without restart markers are split into chunks of at least this many
+// bytes for speculative decoding, smaller ones rarely pay for synchronisation.
+const size_t kMinChunkBytes = 1 << 16;
+
+// Decodes the whole scan. Intervals split by restart markers are decoded
+// independently, a scan without them is split into |threads| chunks which are
+// decoded speculatively and stitched where they synchronise with the true stream.
+// Every worker checks |control|, unless it is null, once per MCU row.
+DecodeStatus DecodeScan(const ScanData &scan, const ScanLayout &layout, size_t threads,
+                        ScanCoefficients &result, const DecodeControl *control = nullptr);
+
+// Decodes MCUs from |cursor| up to |last_mcu| sequentially and advances the
+// cursor. Blocks go to |blocks| unless it is null.
+DecodeStatus DecodeMcus(const ScanData &scan, const ScanLayout &layout, ScanCursor &cursor,
+                        size_t last_mcu, CoefBlock *blocks);
+
+// Walks the scan checking that every block decodes, every restart interval
+// ends right at its marker and the last MCU ends right at EOI. Nothing is
+// stored. |valid_mcus| gets the number of MCUs decoded before the first error
+// and |bit_pos| the position of the first MCU not decoded (or the end).
+DecodeStatus CheckScan(const ScanData &scan, const ScanLayout &layout, size_t &valid_mcus,
+                       size_t &bit_pos);
+
+// Decodes only the dequantised DC value of every block, in bitstream order,
+// skipping over the AC coefficients. |dc| holds mcu_count blocks per MCU.
+DecodeStatus DecodeDcValues(const ScanData &scan, const ScanLayout &layout, int16_t *dc);
@@ -7,7 +7,52 @@ add_library(decoder_faster
         markers.h
         bitreader.h
         bitreader.cpp
+        huffman_lookup.h
+        standard_huffman.h
+        scan_data.h
+        scan_decoder.h
+        scan_decoder.cpp
         structures.h
+        frame_decoder.h
         marker_readers.h
         fft.cpp
+        cpu_dispatch.cpp
+        kernels.cpp
+        mcu_index.cpp
+        read_queue.h
+        read_queue.cpp
+        async_decoder.cpp
+        content_hash.cpp
+        image_cache.cpp
+        dc_image.cpp
+        pixel_sidecar.cpp
+        jpeg_encoder.h
+        jpeg_encoder.cpp
+        decode_cost.cpp
         decoder.cpp)
+
+find_package(Threads REQUIRED)
+target_link_libraries(decoder_faster Threads::Threads)
+
+# Tests also drive the internal headers, e.g. the encoder and the scan decoder.
+target_include_directories(test_decoder_faster PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+
+# Deterministic synthetic jpegs, see tools/jpeg_corpus.cpp for the options.
+add_executable(jpeg_corpus tools/jpeg_corpus.cpp)
+target_include_directories(jpeg_corpus PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(jpeg_corpus decoder_faster)
+
+# Default corpus in the build tree, 1 to 16 MP. Larger sizes up to 400 MP:
+# jpeg_corpus <dir> --megapixels 100,400
+add_custom_target(synthetic_corpus
+        COMMAND ${CMAKE_COMMAND} -E make_directory ${CMAKE_CURRENT_BINARY_DIR}/corpus
+        COMMAND jpeg_corpus ${CMAKE_CURRENT_BINARY_DIR}/corpus
+        DEPENDS jpeg_corpus)
+
+# Fast kernels of every CPU level against the double-precision reference
+# pipeline and the threaded entropy decode against the serial one, see
+# tests/conformance.cpp for the tolerance options.
+add_executable(decoder_conformance tests/conformance.cpp)
+target_include_directories(decoder_conformance PRIVATE ${CMAKE_CURRENT_SOURCE_DIR})
+target_link_libraries(decoder_conformance decoder_faster)
+add_test(NAME decoder_conformance COMMAND decoder_conformance)
@@ -3,8 +3,11 @@
 #include <fftw3.h>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
-#include "huffman.h"
+#include "huffman_lookup.h"
 
 struct YCbCr {
     double y;
@@ -24,6 +27,17 @@ public:
     }
 };
 
+// Natural position of the i-th zigzag coefficient.
+inline constexpr uint8_t kZigZagOrder[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48,
+    41, 34, 27, 20, 13, 6,  7,  14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23,
+    30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+// Dequantised coefficients of one block in natural order, one cache line pair.
+struct alignas(64) CoefBlock {
+    int16_t coef[64];
+};
+
 struct FrameParametrs {
     size_t label;
     size_t hor_sampling;
@@ -37,9 +51,8 @@ struct HuffTabParametrs {
     static const int kMaxSize = 16;
     size_t table_class;
     size_t table_id;
-    std::vector<uint8_t> lenghts;
-    std::vector<uint8_t> values;
-    HuffmanTree huffman;
+    // A prebuilt standard table or one of JpegHeader::custom_huffman_tables.
+    const HuffmanLookup *huffman;
 };
 
 struct QuantTable {
@@ -48,8 +61,15 @@ struct QuantTable {
     Matrix88 table;
 };
 
-struct MCUBlock {
-    std::vector<Matrix88> y_table;
-    Matrix88 cb_table;
-    Matrix88 cr_table;
-};
\ No newline at end of file
+struct JpegHeader {
+    std::unordered_map<size_t, FrameParametrs> frames_pars;
+    std::vector<QuantTable> quant_tables;
+    std::vector<HuffTabParametrs> huffman_tables;
+    std::vector<std::unique_ptr<HuffmanLookup>> custom_huffman_tables;
+    size_t restart_interval = 0;
+    uint16_t height = 0;
+    uint16_t width = 0;
+    // Set by a SOF2 frame, which only HeaderMode::kFrame accepts.
+    bool progressive = false;
+    std::string comment;
+};
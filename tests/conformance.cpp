@@ -0,0 +1,397 @@
+// Decodes a corpus with the kernels of every CPU level the host runs and with
+// the double-precision reference pipeline, prints the error of every stage and
+// fails when one exceeds the tolerances. The entropy decode of every file is
+// also split across threads and must match the serial one exactly. Without
+// files the corpus is a set of synthetic jpegs covering every sampling.
+//
+// decoder_conformance [--max-error 1] [--mean-error 0.05] [--min-psnr 45] [file.jpg...]
+
+#include <cpu_dispatch.h>
+#include <decode_result.h>
+#include <gray_image.h>
+#include <image.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "fft.h"
+#include "frame_decoder.h"
+#include "jpeg_encoder.h"
+#include "util_funcs.h"
+
+namespace {
+
+// Difference of one stage from its reference, in 8-bit sample units.
+struct StageError {
+    std::string stage;
+    size_t samples = 0;
+    double max_error = 0;
+    double mean_error = 0;
+    // Infinite when the stage matches the reference exactly.
+    double psnr = std::numeric_limits<double>::infinity();
+};
+
+// Stages, all computed from the same entropy-decoded coefficients:
+//   idct   - kernel IDCT of every block against ConvertMatrix, before rounding;
+//   colour - kernel colour conversion of the reference samples against
+//            ConvertYCbCrToRGB, channels r, g, b;
+//   image  - pixels of the fast decode against the reference decode, including
+//            chroma upsampling;
+//   luma   - luma-only decode against the truncated reference Y samples.
+struct ConformanceReport {
+    DecodeStatus status = DecodeStatus::kOk;
+    CpuLevel level = CpuLevel::kScalar;
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<StageError> stages;
+
+    bool Ok() const {
+        return status == DecodeStatus::kOk;
+    }
+};
+
+// Defaults allow the off-by-one pixels of truncating slightly different
+// values, anything beyond that is a real drift.
+struct ConformanceTolerance {
+    double max_error = 1;
+    double mean_error = 0.05;
+    double min_psnr = 45;
+};
+
+bool WithinTolerance(const StageError &error, const ConformanceTolerance &tolerance) {
+    return error.max_error <= tolerance.max_error && error.mean_error <= tolerance.mean_error &&
+           error.psnr >= tolerance.min_psnr;
+}
+
+// Accumulates the absolute differences of one stage from the reference.
+class ErrorCounter {
+public:
+    void Add(double value, double reference) {
+        double error = std::abs(value - reference);
+        max_error_ = std::max(max_error_, error);
+        sum_ += error;
+        sum_squares_ += error * error;
+        ++samples_;
+    }
+
+    StageError Result(const char *stage) const {
+        StageError result;
+        result.stage = stage;
+        result.samples = samples_;
+        result.max_error = max_error_;
+        if (samples_ != 0) {
+            result.mean_error = sum_ / samples_;
+            double mse = sum_squares_ / samples_;
+            if (mse != 0) {
+                result.psnr = 10 * std::log10(255. * 255. / mse);
+            }
+        }
+        return result;
+    }
+
+private:
+    double max_error_ = 0;
+    double sum_ = 0;
+    double sum_squares_ = 0;
+    size_t samples_ = 0;
+};
+
+DecodeStatus ReadFrameCoefficients(const std::string &bytes, size_t threads,
+                                   FrameCoefficients &frame) {
+    std::istringstream input(bytes);
+    return ReadCoefficients(input, threads, frame);
+}
+
+DecodeStatus CompareDecode(const std::string &bytes, CpuLevel level, ConformanceReport &report) {
+    if (level > DetectCpuLevel()) {
+        return DecodeStatus::kUnsupported;
+    }
+    const auto &kernels = GetKernels(level);
+    FrameCoefficients frame;
+    auto status = ReadFrameCoefficients(bytes, 0, frame);
+    if (status != DecodeStatus::kOk) {
+        return status;
+    }
+    const auto &layout = frame.layout;
+    const auto &scan = frame.scan;
+    report.width = frame.width;
+    report.height = frame.height;
+
+    Image image;
+    image.SetSize(frame.width, frame.height);
+    McuWriter writer(layout, frame.height, frame.width, kernels);
+    GrayImage luma;
+    luma.width = frame.width;
+    luma.height = frame.height;
+    luma.pixels.assign(luma.width * luma.height, 0);
+    PutLumaBlocks(layout, scan, kernels, luma);
+
+    ErrorCounter idct_error;
+    ErrorCounter colour_error;
+    ErrorCounter image_error;
+    ErrorCounter luma_error;
+    std::vector<double> dct_input(64);
+    std::vector<double> dct_output(64);
+    DctCalculator dct_calc(8, &dct_input, &dct_output);
+    size_t blocks_per_mcu = layout.scan.slot_component.size();
+    size_t hor_sampling = layout.hor_sampling;
+    size_t vert_sampling = layout.vert_sampling;
+    bool colour = layout.comps.size() == 3;
+    std::vector<Matrix88> reference(blocks_per_mcu);
+    alignas(64) float block[64];
+    // One row of reference samples of the current MCU and the same as floats.
+    YCbCr samples[McuWriter::kMaxMcuSize];
+    float y_row[McuWriter::kMaxMcuSize];
+    float cb_row[McuWriter::kMaxMcuSize];
+    float cr_row[McuWriter::kMaxMcuSize];
+    int red[McuWriter::kMaxMcuSize];
+    int green[McuWriter::kMaxMcuSize];
+    int blue[McuWriter::kMaxMcuSize];
+    for (size_t mcu = 0; mcu < layout.scan.mcu_count; ++mcu) {
+        const CoefBlock *blocks = scan.blocks.data() + mcu * blocks_per_mcu;
+        for (size_t slot = 0; slot < blocks_per_mcu; ++slot) {
+            for (size_t id = 0; id < 64; ++id) {
+                reference[slot].Get(id / 8, id % 8) = blocks[slot].coef[id];
+            }
+            ConvertMatrix(reference[slot], dct_calc, &dct_input, &dct_output);
+            kernels.idct(blocks[slot].coef, block);
+            for (size_t id = 0; id < 64; ++id) {
+                idct_error.Add(block[id], reference[slot].Get(id / 8, id % 8));
+            }
+        }
+        writer.Put(mcu, blocks, image, 0, 0);
+
+        // Same sample positions as the reference decoder: chroma of a pixel is
+        // taken from the block position it covers, no interpolation.
+        size_t mcu_y = mcu / layout.mcu_tab_width * layout.mcu_height;
+        size_t mcu_x = mcu % layout.mcu_tab_width * layout.mcu_width;
+        size_t y_end = std::min<size_t>(frame.height, mcu_y + layout.mcu_height);
+        size_t x_end = std::min<size_t>(frame.width, mcu_x + layout.mcu_width);
+        for (size_t y = mcu_y; y < y_end; ++y) {
+            size_t pos_y = y - mcu_y;
+            for (size_t x = mcu_x; x < x_end; ++x) {
+                size_t pos_x = x - mcu_x;
+                auto &sample = samples[pos_x];
+                sample.y = reference[pos_y / 8 * hor_sampling + pos_x / 8].Get(pos_y % 8,
+                                                                                pos_x % 8);
+                sample.cb = 128;
+                sample.cr = 128;
+                if (colour) {
+                    size_t chroma = hor_sampling * vert_sampling;
+                    sample.cb = reference[chroma].Get(pos_y / vert_sampling, pos_x / hor_sampling);
+                    sample.cr =
+                        reference[chroma + 1].Get(pos_y / vert_sampling, pos_x / hor_sampling);
+                }
+                y_row[pos_x] = sample.y;
+                cb_row[pos_x] = sample.cb;
+                cr_row[pos_x] = sample.cr;
+                luma_error.Add(luma.GetPixel(y, x), static_cast<int>(sample.y));
+            }
+            kernels.ycbcr_to_rgb(y_row, cb_row, cr_row, x_end - mcu_x, red, green, blue);
+            for (size_t x = mcu_x; x < x_end; ++x) {
+                size_t id = x - mcu_x;
+                RGB expected = ConvertYCbCrToRGB(samples[id]);
+                colour_error.Add(red[id], expected.r);
+                colour_error.Add(green[id], expected.g);
+                colour_error.Add(blue[id], expected.b);
+                RGB pixel = image.GetPixel(y, x);
+                image_error.Add(pixel.r, expected.r);
+                image_error.Add(pixel.g, expected.g);
+                image_error.Add(pixel.b, expected.b);
+            }
+        }
+    }
+    report.stages = {idct_error.Result("idct"), colour_error.Result("colour"),
+                     image_error.Result("image"), luma_error.Result("luma")};
+    return DecodeStatus::kOk;
+}
+
+// Decodes |bytes| with the kernels of |level| and with the reference pipeline
+// and measures every stage. Levels the host can't run give kUnsupported. The
+// reference runs one FFTW transform per block, so this is meant for test
+// images, not for production sizes.
+ConformanceReport CompareWithReference(const std::string &bytes, CpuLevel level) noexcept {
+    ConformanceReport report;
+    report.level = level;
+    try {
+        report.status = CompareDecode(bytes, level, report);
+    } catch (const std::bad_alloc &) {
+        report.status = DecodeStatus::kOutOfMemory;
+    } catch (...) {
+        report.status = DecodeStatus::kIoError;
+    }
+    if (!report.Ok()) {
+        report.stages.clear();
+    }
+    return report;
+}
+
+// Coefficients of the entropy decode split across |threads|, restart intervals
+// or speculative chunks, against the serial decode. Any difference is a bug.
+StageError CompareEntropyDecode(const std::string &bytes, size_t threads, DecodeStatus &status) {
+    FrameCoefficients serial;
+    FrameCoefficients parallel;
+    status = ReadFrameCoefficients(bytes, 1, serial);
+    if (status == DecodeStatus::kOk) {
+        status = ReadFrameCoefficients(bytes, threads, parallel);
+    }
+    if (status == DecodeStatus::kOk &&
+        serial.scan.blocks.size() != parallel.scan.blocks.size()) {
+        status = DecodeStatus::kIoError;
+    }
+    ErrorCounter error;
+    for (size_t id = 0; status == DecodeStatus::kOk && id < serial.scan.blocks.size(); ++id) {
+        for (size_t coef = 0; coef < 64; ++coef) {
+            error.Add(parallel.scan.blocks[id].coef[coef], serial.scan.blocks[id].coef[coef]);
+        }
+    }
+    return error.Result("entropy");
+}
+
+struct CorpusImage {
+    std::string name;
+    std::string bytes;
+};
+
+// Odd sizes leave partial MCUs on both edges.
+std::vector<CorpusImage> MakeSyntheticCorpus() {
+    const std::pair<const char *, Subsampling> kSamplings[] = {{"gray", Subsampling::kGray},
+                                                               {"444", Subsampling::k444},
+                                                               {"422", Subsampling::k422},
+                                                               {"420", Subsampling::k420}};
+    std::vector<CorpusImage> corpus;
+    for (const auto &[sampling, subsampling] : kSamplings) {
+        for (int quality : {50, 95}) {
+            EncoderOptions options;
+            options.width = 203;
+            options.height = 157;
+            options.subsampling = subsampling;
+            options.quality = quality;
+            options.restart_interval = quality == 50 ? 7 : 0;
+            std::ostringstream output;
+            EncodeJpeg(options,
+                       MakeSyntheticSource(options.width, subsampling == Subsampling::kGray, 1),
+                       output);
+            corpus.push_back(
+                {std::string(sampling) + "_q" + std::to_string(quality), output.str()});
+        }
+    }
+    // Large enough to be split into speculative chunks, which need no restarts.
+    EncoderOptions options;
+    options.width = 1024;
+    options.height = 768;
+    options.subsampling = Subsampling::k444;
+    options.quality = 95;
+    std::ostringstream output;
+    EncodeJpeg(options, MakeSyntheticSource(options.width, false, 1), output);
+    corpus.push_back({"444_q95_chunked", output.str()});
+    return corpus;
+}
+
+CorpusImage ReadFile(const std::string &path) {
+    std::ifstream input(path, std::ios::binary);
+    std::ostringstream bytes;
+    bytes << input.rdbuf();
+    if (!input) {
+        throw std::runtime_error("Can't read " + path);
+    }
+    return {path, bytes.str()};
+}
+
+// More than one chunk per worker of a typical host.
+const size_t kEntropyThreads = 7;
+
+int Usage() {
+    std::cerr << "Usage: decoder_conformance [--max-error 1] [--mean-error 0.05] "
+                 "[--min-psnr 45] [file.jpg...]\n";
+    return 2;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    ConformanceTolerance tolerance;
+    std::vector<std::string> paths;
+    try {
+        for (int id = 1; id < argc; ++id) {
+            std::string arg = argv[id];
+            if (arg.rfind("--", 0) != 0) {
+                paths.push_back(arg);
+                continue;
+            }
+            if (id + 1 == argc) {
+                return Usage();
+            }
+            double value = std::stod(argv[++id]);
+            if (arg == "--max-error") {
+                tolerance.max_error = value;
+            } else if (arg == "--mean-error") {
+                tolerance.mean_error = value;
+            } else if (arg == "--min-psnr") {
+                tolerance.min_psnr = value;
+            } else {
+                return Usage();
+            }
+        }
+    } catch (const std::exception &) {
+        return Usage();
+    }
+
+    std::vector<CorpusImage> corpus;
+    try {
+        if (paths.empty()) {
+            corpus = MakeSyntheticCorpus();
+        }
+        for (const auto &path : paths) {
+            corpus.push_back(ReadFile(path));
+        }
+    } catch (const std::exception &error) {
+        std::cerr << error.what() << '\n';
+        return 2;
+    }
+
+    size_t failures = 0;
+    std::cout << std::setprecision(4);
+    for (const auto &image : corpus) {
+        DecodeStatus status;
+        auto entropy = CompareEntropyDecode(image.bytes, kEntropyThreads, status);
+        std::cout << image.name << ' ' << entropy.stage;
+        if (status != DecodeStatus::kOk) {
+            std::cout << " FAIL " << DecodeStatusMessage(status) << '\n';
+        } else if (entropy.max_error != 0) {
+            std::cout << " FAIL max " << entropy.max_error << " mean " << entropy.mean_error
+                      << '\n';
+        } else {
+            std::cout << " exact\n";
+        }
+        failures += status != DecodeStatus::kOk || entropy.max_error != 0;
+        for (int level = 0; level <= static_cast<int>(DetectCpuLevel()); ++level) {
+            auto report = CompareWithReference(image.bytes, static_cast<CpuLevel>(level));
+            std::cout << image.name << ' ' << CpuLevelName(report.level);
+            if (!report.Ok()) {
+                std::cout << " FAIL " << DecodeStatusMessage(report.status) << '\n';
+                ++failures;
+                continue;
+            }
+            std::cout << ' ' << report.width << 'x' << report.height << '\n';
+            for (const auto &stage : report.stages) {
+                bool ok = WithinTolerance(stage, tolerance);
+                std::cout << "  " << std::left << std::setw(7) << stage.stage << std::right
+                          << " max " << stage.max_error << " mean " << stage.mean_error
+                          << " psnr " << stage.psnr << (ok ? "" : " FAIL") << '\n';
+                failures += !ok;
+            }
+        }
+    }
+    std::cout << failures << " failures" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
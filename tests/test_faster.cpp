@@ -2,8 +2,155 @@
 
 #include <catch.hpp>
 
+#include <async_decoder.h>
+#include <content_hash.h>
+#include <cpu_dispatch.h>
+#include <dc_image.h>
+#include <decode_cost.h>
+#include <decode_result.h>
+#include <decoder.h>
+#include <gray_image.h>
+#include <image_cache.h>
+#include <mcu_index.h>
+#include <pixel_sidecar.h>
+#include <validate.h>
+
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+#include "frame_decoder.h"
+#include "jpeg_encoder.h"
+#include "standard_huffman.h"
+
+namespace {
+
+std::string EncodeSynthetic(size_t width, size_t height, Subsampling subsampling,
+                            int quality = 75, size_t restart_interval = 0,
+                            bool optimize_huffman = false) {
+    EncoderOptions options;
+    options.width = width;
+    options.height = height;
+    options.subsampling = subsampling;
+    options.quality = quality;
+    options.restart_interval = restart_interval;
+    options.optimize_huffman = optimize_huffman;
+    std::ostringstream output;
+    EncodeJpeg(options, MakeSyntheticSource(width, subsampling == Subsampling::kGray, 1), output);
+    return output.str();
+}
+
+bool SameImage(const Image &lhs, const Image &rhs) {
+    if (lhs.Width() != rhs.Width() || lhs.Height() != rhs.Height()) {
+        return false;
+    }
+    for (size_t y = 0; y < lhs.Height(); ++y) {
+        for (size_t x = 0; x < lhs.Width(); ++x) {
+            auto left = lhs.GetPixel(y, x);
+            auto right = rhs.GetPixel(y, x);
+            if (left.r != right.r || left.g != right.g || left.b != right.b) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+Image DecodeString(const std::string &data) {
+    std::istringstream input(data);
+    return Decode(input);
+}
+
+// Directory of its own under temp_directory_path(), removed with its files,
+// so concurrent test runs never share a path.
+class TempDir {
+public:
+    TempDir() {
+        auto pattern = (std::filesystem::temp_directory_path() / "faster_test_XXXXXX").string();
+        if (mkdtemp(pattern.data()) == nullptr) {
+            throw std::runtime_error("Can't create " + pattern);
+        }
+        path_ = pattern;
+    }
+
+    ~TempDir() {
+        std::error_code error;
+        std::filesystem::remove_all(path_, error);
+    }
+
+    TempDir(const TempDir &) = delete;
+    TempDir &operator=(const TempDir &) = delete;
+
+    std::string Path(const std::string &name) const {
+        return (path_ / name).string();
+    }
+
+    std::string WriteFile(const std::string &name, const std::string &data) const {
+        auto path = Path(name);
+        std::ofstream(path, std::ios::binary) << data;
+        return path;
+    }
+
+private:
+    std::filesystem::path path_;
+};
+
+// Offset of the first entropy-coded byte, right after the SOS segment.
+size_t ScanStart(const std::string &data) {
+    size_t sos = data.find("\xff\xda");
+    size_t length = static_cast<uint8_t>(data[sos + 2]) << 8 | static_cast<uint8_t>(data[sos + 3]);
+    return sos + 2 + length;
+}
+
+// An 8x8 frame whose blocks each hold one AC value of 11 bits, which quant
+// tables of all ones and a hand-made Huffman table allow.
+std::string MakeWideAcJpeg(bool colour) {
+    std::string data("\xff\xd8\xff\xdb\x00\x43\x00", 7);
+    data += std::string(64, '\x01');
+    if (colour) {
+        data += std::string("\xff\xc0\x00\x11\x08\x00\x08\x00\x08\x03"
+                            "\x01\x11\x00\x02\x11\x00\x03\x11\x00",
+                            19);
+    } else {
+        data += std::string("\xff\xc0\x00\x0b\x08\x00\x08\x00\x08\x01\x01\x11\x00", 13);
+    }
+    // DC: '0' is size 0. AC: '0' is run 0 size 11, '1' is EOB.
+    data += std::string("\xff\xc4\x00\x14\x00\x01", 6) + std::string(15, '\x00') + '\x00';
+    data += std::string("\xff\xc4\x00\x15\x10\x02", 6) + std::string(15, '\x00') + "\x0b" +
+            '\x00';
+    if (colour) {
+        data += std::string("\xff\xda\x00\x0c\x03\x01\x00\x02\x00\x03\x00\x00\x3f\x00", 14);
+    } else {
+        data += std::string("\xff\xda\x00\x08\x01\x01\x00\x00\x3f\x00", 10);
+    }
+    // Every block is 0 0 11111111111 1, padded with ones.
+    std::string bits;
+    for (size_t block = 0; block < (colour ? 3 : 1); ++block) {
+        bits += "00" + std::string(11, '1') + "1";
+    }
+    bits.resize((bits.size() + 7) / 8 * 8, '1');
+    for (size_t pos = 0; pos < bits.size(); pos += 8) {
+        auto byte = static_cast<char>(std::stoi(bits.substr(pos, 8), nullptr, 2));
+        data += byte;
+        if (byte == '\xff') {
+            data += '\x00';
+        }
+    }
+    return data + "\xff\xd9";
+}
+
+}  // namespace
 
 TEST_CASE("huge", "[jpg]") {
 #ifdef NDEBUG
@@ -17,3 +164,713 @@ TEST_CASE("huge", "[jpg]") {
         << std::endl;
 #endif
 }
+
+TEST_CASE("kernels", "[cpu]") {
+    const auto &reference = GetKernels(CpuLevel::kScalar);
+    for (auto level : {CpuLevel::kSse42, CpuLevel::kAvx2, CpuLevel::kAvx512}) {
+        if (level > DetectCpuLevel()) {
+            REQUIRE_THROWS(ForceCpuLevel(level));
+            continue;
+        }
+        INFO(CpuLevelName(level));
+        const auto &kernels = GetKernels(level);
+        std::mt19937 rng(42);
+        for (int iter = 0; iter < 100; ++iter) {
+            int16_t coefs[64];
+            for (int id = 0; id < 64; ++id) {
+                coefs[id] = static_cast<int>(rng() % (4096 >> (id / 8))) - (2048 >> (id / 8));
+            }
+            float expected[64];
+            float actual[64];
+            reference.idct(coefs, expected);
+            kernels.idct(coefs, actual);
+            for (int id = 0; id < 64; ++id) {
+                REQUIRE(std::abs(expected[id] - actual[id]) < 1e-2);
+            }
+
+            size_t count = rng() % 40;
+            float src[3][40];
+            for (auto &plane : src) {
+                for (auto &val : plane) {
+                    val = static_cast<float>(rng() % 25600) / 100;
+                }
+            }
+            float expected_up[80];
+            float actual_up[80];
+            reference.upsample_h2(src[0], count, expected_up);
+            kernels.upsample_h2(src[0], count, actual_up);
+            for (size_t id = 0; id < 2 * count; ++id) {
+                REQUIRE(expected_up[id] == actual_up[id]);
+            }
+
+            int expected_rgb[3][40];
+            int actual_rgb[3][40];
+            reference.ycbcr_to_rgb(src[0], src[1], src[2], count, expected_rgb[0], expected_rgb[1],
+                                   expected_rgb[2]);
+            kernels.ycbcr_to_rgb(src[0], src[1], src[2], count, actual_rgb[0], actual_rgb[1],
+                                 actual_rgb[2]);
+            for (int channel = 0; channel < 3; ++channel) {
+                for (size_t id = 0; id < count; ++id) {
+                    REQUIRE(std::abs(expected_rgb[channel][id] - actual_rgb[channel][id]) <= 1);
+                }
+            }
+        }
+        auto saved = GetCpuLevel();
+        ForceCpuLevel(level);
+        REQUIRE(GetCpuLevel() == level);
+        ForceCpuLevel(saved);
+    }
+}
+
+TEST_CASE("statuses", "[jpg]") {
+    auto status = [](const std::string &data) {
+        std::istringstream input(data);
+        return TryDecode(input).status;
+    };
+    REQUIRE(status("") == DecodeStatus::kTruncated);
+    REQUIRE(status("\xff\xd8\xff") == DecodeStatus::kTruncated);
+    REQUIRE(status("\x89PNG") == DecodeStatus::kBadMarker);
+    REQUIRE(status(std::string("\xff\xd8\xff\x01\x00\x00", 6)) == DecodeStatus::kBadMarker);
+    REQUIRE(status(std::string("\xff\xd8\xff\xc2\x00\x0b", 6)) == DecodeStatus::kUnsupported);
+    // DQT with a 16-bit table.
+    REQUIRE(status(std::string("\xff\xd8\xff\xdb\x00\x43\x10", 7)) ==
+            DecodeStatus::kBadQuantTable);
+
+    std::istringstream input("");
+    REQUIRE_THROWS_AS(Decode(input), std::runtime_error);
+}
+
+TEST_CASE("async missing file", "[jpg]") {
+    AsyncDecoder decoder;
+    auto result = decoder.Decode("/nonexistent/image.jpg");
+    REQUIRE(result.get().status == DecodeStatus::kIoError);
+}
+
+TEST_CASE("async matches sync decode", "[jpg]") {
+    std::vector<std::string> files = {EncodeSynthetic(203, 157, Subsampling::k420, 95),
+                                      EncodeSynthetic(320, 240, Subsampling::kGray, 75, 3),
+                                      EncodeSynthetic(96, 64, Subsampling::k422)};
+    TempDir dir;
+    std::vector<std::string> paths;
+    for (size_t id = 0; id < files.size(); ++id) {
+        paths.push_back(dir.WriteFile(std::to_string(id) + ".jpg", files[id]));
+    }
+    // Fewer buffers than chunks of a single file, so reads wait for the
+    // decoders to hand buffers back.
+    for (bool use_io_uring : {false, true}) {
+        AsyncDecodeOptions options;
+        options.buffer_size = 4096;
+        options.buffer_count = 3;
+        options.use_io_uring = use_io_uring;
+        AsyncDecoder decoder(options);
+        REQUIRE(files[0].size() > 3 * options.buffer_size);
+        std::vector<std::future<DecodeResult>> results;
+        for (const auto &path : paths) {
+            results.push_back(decoder.Decode(path));
+        }
+        for (size_t id = 0; id < files.size(); ++id) {
+            auto result = results[id].get();
+            REQUIRE(result.Ok());
+            REQUIRE(SameImage(result.image, DecodeString(files[id])));
+        }
+    }
+}
+
+TEST_CASE("cache does not keep failures", "[jpg]") {
+    ImageCache cache(1 << 20);
+    const uint8_t data[] = {0xff, 0xd8, 0xff, 0x01};
+    for (int iter = 0; iter < 2; ++iter) {
+        REQUIRE(cache.Get(data, sizeof(data))->status == DecodeStatus::kBadMarker);
+    }
+    auto stats = cache.Stats();
+    REQUIRE(stats.misses == 2);
+    REQUIRE(stats.hits == 0);
+    REQUIRE(stats.entries == 0);
+}
+
+TEST_CASE("cache hits and lru eviction", "[jpg]") {
+    std::vector<std::string> files;
+    for (int quality : {60, 70, 80}) {
+        files.push_back(EncodeSynthetic(64, 48, Subsampling::k420, quality));
+    }
+    auto get = [](ImageCache &cache, const std::string &data) {
+        return cache.Get(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    };
+    ImageCache probe(1 << 20, 1);
+    size_t bytes = DecodeResultBytes(*get(probe, files[0]));
+
+    // Room for two images in one shard.
+    ImageCache cache(2 * bytes + bytes / 2, 1);
+    auto first = get(cache, files[0]);
+    REQUIRE(first->Ok());
+    REQUIRE(SameImage(first->image, DecodeString(files[0])));
+    REQUIRE(get(cache, files[0]) == first);
+    get(cache, files[1]);
+    get(cache, files[0]);
+    get(cache, files[2]);
+    auto stats = cache.Stats();
+    REQUIRE(stats.hits == 2);
+    REQUIRE(stats.misses == 3);
+    REQUIRE(stats.evictions == 1);
+    REQUIRE(stats.entries == 2);
+    REQUIRE(stats.bytes == 2 * bytes);
+    // files[1] was the least recently used.
+    REQUIRE(get(cache, files[0]) == first);
+    get(cache, files[1]);
+    REQUIRE(cache.Stats().misses == 4);
+
+    // The budget is shared, an image larger than budget / shards still fits.
+    ImageCache sharded(3 * bytes, 16);
+    get(sharded, files[0]);
+    REQUIRE(sharded.Stats().entries == 1);
+    ImageCache tiny(bytes - 1, 1);
+    get(tiny, files[0]);
+    REQUIRE(tiny.Stats().entries == 0);
+}
+
+TEST_CASE("cache decodes a key once", "[jpg]") {
+    auto data = EncodeSynthetic(640, 480, Subsampling::k444, 90);
+    ImageCache cache(1 << 30);
+    std::vector<std::shared_ptr<const DecodeResult>> results(8);
+    std::vector<std::thread> threads;
+    for (size_t id = 0; id < results.size(); ++id) {
+        threads.emplace_back([&, id] {
+            results[id] = cache.Get(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (const auto &result : results) {
+        REQUIRE(result == results[0]);
+    }
+    auto stats = cache.Stats();
+    REQUIRE(stats.misses == 1);
+    REQUIRE(stats.hits == results.size() - 1);
+}
+
+TEST_CASE("standard huffman tables", "[jpg]") {
+    // The encoder writes the Annex K tables unless it optimises them.
+    auto data = EncodeSynthetic(64, 48, Subsampling::k420);
+    const auto *bytes = reinterpret_cast<const uint8_t *>(data.data());
+    size_t found = 0;
+    for (size_t pos = 0; pos + 4 < data.size() && !(bytes[pos] == 0xff && bytes[pos + 1] == 0xda);
+         ++pos) {
+        if (bytes[pos] != 0xff || bytes[pos + 1] != 0xc4) {
+            continue;
+        }
+        size_t end = pos + 2 + (bytes[pos + 2] << 8 | bytes[pos + 3]);
+        for (size_t table = pos + 4; table < end;) {
+            size_t size = 0;
+            for (size_t len = 0; len < 16; ++len) {
+                size += bytes[table + 1 + len];
+            }
+            size_t id = (bytes[table] >> 4) * 2 + (bytes[table] & 15);
+            REQUIRE(FindStandardHuffmanTable(bytes + table + 1, bytes + table + 17, size) ==
+                    &kStandardHuffmanLookups[id]);
+            ++found;
+            table += 17 + size;
+        }
+    }
+    REQUIRE(found == 4);
+
+    // Tables built at run time decode every 16-bit prefix the same way.
+    for (size_t id = 0; id < 4; ++id) {
+        HuffmanLookup built;
+        REQUIRE(built.Build(kStandardHuffmanSpecs[id].code_lengths,
+                            kStandardHuffmanSpecs[id].values));
+        size_t mismatches = 0;
+        for (uint32_t bits = 0; bits < (1u << 16); ++bits) {
+            uint8_t stream[4] = {static_cast<uint8_t>(bits >> 8), static_cast<uint8_t>(bits), 0,
+                                 0};
+            ScanBitReader prebuilt_reader(stream, sizeof(stream));
+            ScanBitReader built_reader(stream, sizeof(stream));
+            mismatches += kStandardHuffmanLookups[id].Decode(prebuilt_reader) !=
+                              built.Decode(built_reader) ||
+                          prebuilt_reader.GetCurPos() != built_reader.GetCurPos();
+        }
+        REQUIRE(mismatches == 0);
+    }
+
+    // Same coefficients coded with custom tables decode to the same pixels.
+    auto custom = EncodeSynthetic(64, 48, Subsampling::k420, 75, 0, true);
+    REQUIRE(custom != data);
+    REQUIRE(SameImage(DecodeString(custom), DecodeString(data)));
+}
+
+TEST_CASE("validate rejects broken headers", "[jpg]") {
+    std::istringstream truncated(std::string("\xff\xd8\xff\xdb\x00\x43\x00", 7));
+    auto report = Validate(truncated);
+    REQUIRE(report.status == DecodeStatus::kTruncated);
+    REQUIRE(report.mcu_count == 0);
+
+    std::istringstream no_scan(std::string("\xff\xd8\xff\xd9", 4));
+    REQUIRE(Validate(no_scan).status == DecodeStatus::kBadMarker);
+}
+
+TEST_CASE("validate accepts encoded files", "[jpg]") {
+    const std::pair<Subsampling, size_t> kMcuCounts[] = {{Subsampling::kGray, 26 * 20},
+                                                         {Subsampling::k444, 26 * 20},
+                                                         {Subsampling::k422, 13 * 20},
+                                                         {Subsampling::k420, 13 * 10}};
+    for (auto [subsampling, mcu_count] : kMcuCounts) {
+        for (size_t restart_interval : {0, 5}) {
+            auto data = EncodeSynthetic(203, 157, subsampling, 75, restart_interval);
+            std::istringstream input(data);
+            auto report = Validate(input);
+            REQUIRE(report.Ok());
+            REQUIRE(report.width == 203);
+            REQUIRE(report.height == 157);
+            REQUIRE(report.components == (subsampling == Subsampling::kGray ? 1 : 3));
+            REQUIRE(report.restart_interval == restart_interval);
+            REQUIRE(report.mcu_count == mcu_count);
+            REQUIRE(report.valid_mcus == mcu_count);
+            REQUIRE(report.trailing_bytes == 0);
+
+            // Cut in the middle of the scan, the MCUs in front of the cut are
+            // still checked.
+            size_t scan_start = ScanStart(data);
+            std::istringstream truncated(data.substr(0, data.size() * 3 / 4));
+            report = Validate(truncated);
+            REQUIRE(report.status == DecodeStatus::kTruncated);
+            REQUIRE(report.valid_mcus > 0);
+            REQUIRE(report.valid_mcus < mcu_count);
+            REQUIRE(report.error_offset >= scan_start);
+            REQUIRE(report.error_offset < data.size() * 3 / 4);
+
+            // Garbage in the middle of a scan that still ends with EOI: a run of
+            // one bits is no Huffman code, so decoding can't resynchronise.
+            auto corrupted = data;
+            size_t middle = (scan_start + data.size()) / 2;
+            while (corrupted.substr(middle - 1, 10).find('\xff') != std::string::npos) {
+                ++middle;
+            }
+            corrupted.replace(middle, 8, std::string("\xff\x00\xff\x00\xff\x00\xff\x00", 8));
+            std::istringstream broken(corrupted);
+            report = Validate(broken);
+            REQUIRE(!report.Ok());
+            REQUIRE(report.valid_mcus > 0);
+            REQUIRE(report.valid_mcus < mcu_count);
+            REQUIRE(report.error_offset >= scan_start);
+            REQUIRE(report.error_offset < data.size() - 2);
+        }
+    }
+
+    // 11-bit AC values, which Decode accepts.
+    for (bool colour : {false, true}) {
+        std::istringstream input(MakeWideAcJpeg(colour));
+        REQUIRE(TryDecode(input).Ok());
+        input.clear();
+        input.seekg(0);
+        auto report = Validate(input);
+        REQUIRE(report.Ok());
+        REQUIRE(report.valid_mcus == 1);
+    }
+}
+
+TEST_CASE("dc image summaries", "[jpg]") {
+    // Gray 16x16 blocks, dark left half and bright right half.
+    DcImage image;
+    image.width = image.height = 128;
+    DcPlane plane;
+    plane.width = plane.height = 16;
+    for (size_t y = 0; y < 16; ++y) {
+        for (size_t x = 0; x < 16; ++x) {
+            plane.values.push_back(x < 8 ? -8 * 64 : 8 * 64);
+        }
+    }
+    image.planes.push_back(plane);
+
+    auto colour = DcAverageColour(image);
+    REQUIRE(colour.r == 128);
+    REQUIRE(colour.b == 128);
+    auto histogram = DcColourHistogram(image);
+    REQUIRE(histogram[1][64 * kDcHistogramBins / 256] == 128);
+    REQUIRE(histogram[1][192 * kDcHistogramBins / 256] == 128);
+    REQUIRE(DcAverageHash(image) == 0xf0f0f0f0f0f0f0f0ull);
+    REQUIRE(HashDistance(DcDctHash(image), DcDctHash(image)) == 0);
+
+    std::istringstream broken("\xff\xd8\xff");
+    REQUIRE(ExtractDcImage(broken).status == DecodeStatus::kTruncated);
+}
+
+TEST_CASE("dc image of encoded files", "[jpg]") {
+    // Whole MCUs, so every block covers the same number of pixels.
+    for (auto subsampling : {Subsampling::kGray, Subsampling::k444, Subsampling::k420}) {
+        auto data = EncodeSynthetic(208, 160, subsampling);
+        std::istringstream input(data);
+        auto dc = ExtractDcImage(input);
+        REQUIRE(dc.Ok());
+        REQUIRE(dc.width == 208);
+        REQUIRE(dc.height == 160);
+        REQUIRE(dc.planes.size() == (subsampling == Subsampling::kGray ? 1 : 3));
+        REQUIRE(dc.planes[0].width == 26);
+        REQUIRE(dc.planes[0].height == 20);
+
+        auto image = DecodeString(data);
+        double sum[3] = {0, 0, 0};
+        for (size_t y = 0; y < image.Height(); ++y) {
+            for (size_t x = 0; x < image.Width(); ++x) {
+                auto pixel = image.GetPixel(y, x);
+                sum[0] += pixel.r;
+                sum[1] += pixel.g;
+                sum[2] += pixel.b;
+            }
+        }
+        double pixels = image.Width() * image.Height();
+        auto colour = DcAverageColour(dc);
+        REQUIRE(std::abs(colour.r - sum[0] / pixels) <= 3);
+        REQUIRE(std::abs(colour.g - sum[1] / pixels) <= 3);
+        REQUIRE(std::abs(colour.b - sum[2] / pixels) <= 3);
+    }
+}
+
+TEST_CASE("dc image accepts what decode accepts", "[jpg]") {
+    std::vector<std::string> files = {MakeWideAcJpeg(false), MakeWideAcJpeg(true)};
+    for (auto subsampling :
+         {Subsampling::kGray, Subsampling::k444, Subsampling::k422, Subsampling::k420}) {
+        for (size_t restart_interval : {0, 5}) {
+            auto data = EncodeSynthetic(67, 45, subsampling, 95, restart_interval);
+            files.push_back(data);
+            files.push_back(data.substr(0, data.size() - 2));
+            files.push_back(data.substr(0, data.size() / 2));
+        }
+    }
+    size_t decoded = 0;
+    for (const auto &data : files) {
+        std::istringstream input(data);
+        if (!TryDecode(input).Ok()) {
+            continue;
+        }
+        ++decoded;
+        std::istringstream dc_input(data);
+        REQUIRE(ExtractDcImage(dc_input).Ok());
+    }
+    REQUIRE(decoded >= 10);
+}
+
+TEST_CASE("luma statuses", "[jpg]") {
+    std::istringstream truncated("\xff\xd8\xff");
+    REQUIRE(TryDecodeLuma(truncated).status == DecodeStatus::kTruncated);
+    std::istringstream progressive(std::string("\xff\xd8\xff\xc2\x00\x0b", 6));
+    REQUIRE_THROWS_AS(DecodeLuma(progressive), std::runtime_error);
+}
+
+TEST_CASE("luma accepts what decode accepts", "[jpg]") {
+    // Chroma blocks are only skipped, they must pass the same checks.
+    std::vector<std::string> files = {MakeWideAcJpeg(false), MakeWideAcJpeg(true)};
+    for (auto subsampling : {Subsampling::k444, Subsampling::k422, Subsampling::k420}) {
+        files.push_back(EncodeSynthetic(67, 45, subsampling, 95, 5));
+    }
+    for (const auto &data : files) {
+        std::istringstream input(data);
+        auto image = TryDecode(input);
+        REQUIRE(image.Ok());
+        std::istringstream luma_input(data);
+        auto luma = TryDecodeLuma(luma_input);
+        REQUIRE(luma.Ok());
+        REQUIRE(luma.image.width == image.image.Width());
+        REQUIRE(luma.image.height == image.image.Height());
+    }
+}
+
+TEST_CASE("luma matches decode on gray files", "[jpg]") {
+    for (size_t restart_interval : {0, 7}) {
+        auto data = EncodeSynthetic(203, 157, Subsampling::kGray, 75, restart_interval);
+        std::istringstream input(data);
+        auto gray = DecodeLuma(input);
+        auto image = DecodeString(data);
+        REQUIRE(gray.width == image.Width());
+        REQUIRE(gray.height == image.Height());
+        size_t mismatches = 0;
+        for (size_t y = 0; y < gray.height; ++y) {
+            for (size_t x = 0; x < gray.width; ++x) {
+                auto pixel = image.GetPixel(y, x);
+                mismatches += gray.GetPixel(y, x) != pixel.r || pixel.r != pixel.g ||
+                              pixel.g != pixel.b;
+            }
+        }
+        REQUIRE(mismatches == 0);
+    }
+}
+
+TEST_CASE("sidecar round trip", "[jpg]") {
+    GrayImage image;
+    image.width = 70;
+    image.height = 3;
+    for (size_t id = 0; id < image.width * image.height; ++id) {
+        image.pixels.push_back(id % 251);
+    }
+    TempDir dir;
+    auto path = dir.Path("image.raw");
+    REQUIRE(WriteSidecar(path, image, 42, 1000) == SidecarStatus::kOk);
+
+    PixelSidecar sidecar;
+    REQUIRE(sidecar.Open(path, 43, 1000) == SidecarStatus::kStale);
+    REQUIRE(!sidecar.IsOpen());
+    REQUIRE(sidecar.Open(path, 42, 1000) == SidecarStatus::kOk);
+    const auto &view = sidecar.View();
+    REQUIRE(view.format == PixelFormat::kGray8);
+    REQUIRE(view.width == 70);
+    REQUIRE(view.height == 3);
+    REQUIRE(view.stride % kSidecarAlignment == 0);
+    for (size_t y = 0; y < image.height; ++y) {
+        REQUIRE(reinterpret_cast<uintptr_t>(view.Row(y)) % kSidecarAlignment == 0);
+        for (size_t x = 0; x < image.width; ++x) {
+            REQUIRE(view.Row(y)[x] == image.GetPixel(y, x));
+        }
+    }
+}
+
+TEST_CASE("sidecar of a jpeg file", "[jpg]") {
+    // Every write renames a new file into place, so the inode tells a hit from a rewrite.
+    auto inode = [](const std::string &path) {
+        struct stat info;
+        REQUIRE(stat(path.c_str(), &info) == 0);
+        return info.st_ino;
+    };
+    auto same_pixels = [](const PixelView &view, const Image &image) {
+        REQUIRE(view.width == image.Width());
+        REQUIRE(view.height == image.Height());
+        size_t mismatches = 0;
+        for (size_t y = 0; y < view.height; ++y) {
+            for (size_t x = 0; x < view.width; ++x) {
+                auto pixel = image.GetPixel(y, x);
+                const uint8_t *rgb = view.Row(y) + 3 * x;
+                mismatches += rgb[0] != pixel.r || rgb[1] != pixel.g || rgb[2] != pixel.b;
+            }
+        }
+        return mismatches == 0;
+    };
+
+    auto first = EncodeSynthetic(67, 45, Subsampling::k420);
+    TempDir dir;
+    auto jpeg_path = dir.WriteFile("image.jpg", first);
+    auto sidecar_path = dir.Path("image.raw");
+
+    PixelSidecar sidecar;
+    REQUIRE(DecodeFileWithSidecar(jpeg_path, sidecar_path, PixelFormat::kRgb8, sidecar) ==
+            DecodeStatus::kOk);
+    REQUIRE(same_pixels(sidecar.View(), DecodeString(first)));
+    auto written = inode(sidecar_path);
+
+    PixelSidecar hit;
+    REQUIRE(DecodeFileWithSidecar(jpeg_path, sidecar_path, PixelFormat::kRgb8, hit) ==
+            DecodeStatus::kOk);
+    REQUIRE(inode(sidecar_path) == written);
+    REQUIRE(same_pixels(hit.View(), DecodeString(first)));
+
+    auto second = EncodeSynthetic(67, 45, Subsampling::k420, 95);
+    dir.WriteFile("image.jpg", second);
+    PixelSidecar stale;
+    REQUIRE(DecodeFileWithSidecar(jpeg_path, sidecar_path, PixelFormat::kRgb8, stale) ==
+            DecodeStatus::kOk);
+    REQUIRE(inode(sidecar_path) != written);
+    REQUIRE(same_pixels(stale.View(), DecodeString(second)));
+
+    // Concurrent writers of one sidecar each use their own temporary file.
+    GrayImage image;
+    image.width = 300;
+    image.height = 200;
+    image.pixels.assign(image.width * image.height, 7);
+    std::vector<std::thread> writers;
+    std::vector<SidecarStatus> statuses(8);
+    for (size_t id = 0; id < statuses.size(); ++id) {
+        writers.emplace_back(
+            [&, id] { statuses[id] = WriteSidecar(sidecar_path, image, 42, 1000); });
+    }
+    for (auto &writer : writers) {
+        writer.join();
+    }
+    for (auto status : statuses) {
+        REQUIRE(status == SidecarStatus::kOk);
+    }
+    PixelSidecar shared;
+    REQUIRE(shared.Open(sidecar_path, 42, 1000) == SidecarStatus::kOk);
+    REQUIRE(shared.View().Row(199)[299] == 7);
+}
+
+TEST_CASE("frame info", "[jpg]") {
+    std::string progressive("\xff\xd8\xff\xc2\x00\x0b\x08\x00\x10\x00\x20\x01\x01\x11\x00"
+                            "\xff\xda",
+                            17);
+    std::istringstream input(progressive);
+    FrameInfo frame;
+    REQUIRE(ReadFrameInfo(input, progressive.size(), frame) == DecodeStatus::kOk);
+    REQUIRE(frame.progressive);
+    REQUIRE(!frame.supported);
+    REQUIRE(frame.width == 32);
+    REQUIRE(frame.height == 16);
+    REQUIRE(!EstimateDecodeCost(frame, DecodeCostModel()).supported);
+
+    frame.progressive = false;
+    frame.supported = true;
+    frame.width = frame.height = 1000;
+    DecodeCostModel model;
+    model.per_pixel = 1e-8;
+    auto cost = EstimateDecodeCost(frame, model);
+    REQUIRE(cost.peak_bytes > frame.width * frame.height * sizeof(RGB));
+    REQUIRE(cost.seconds == Approx(0.01));
+}
+
+TEST_CASE("synthetic corpus decodes", "[jpg]") {
+    // The option grid of tools/jpeg_corpus.cpp on a small frame. Restarts and
+    // Huffman tables change only the entropy coding, so they decode alike.
+    const size_t width = 97;
+    const size_t height = 61;
+    for (auto subsampling :
+         {Subsampling::kGray, Subsampling::k444, Subsampling::k422, Subsampling::k420}) {
+        bool gray = subsampling == Subsampling::kGray;
+        auto source = MakeSyntheticSource(width, gray, 1);
+        std::vector<uint8_t> row(width * (gray ? 1 : 3));
+        double previous_psnr = 0;
+        for (int quality : {50, 75, 95}) {
+            auto image = DecodeString(EncodeSynthetic(width, height, subsampling, quality));
+            for (size_t restart_interval : {0, 64}) {
+                for (bool optimize_huffman : {false, true}) {
+                    auto other = DecodeString(EncodeSynthetic(width, height, subsampling, quality,
+                                                              restart_interval, optimize_huffman));
+                    REQUIRE(SameImage(image, other));
+                }
+            }
+
+            double squared_error = 0;
+            for (size_t y = 0; y < height; ++y) {
+                source(y, row.data());
+                for (size_t x = 0; x < width; ++x) {
+                    auto pixel = image.GetPixel(y, x);
+                    for (int channel = 0; channel < 3; ++channel) {
+                        int expected = gray ? row[x] : row[3 * x + channel];
+                        int actual = channel == 0 ? pixel.r : channel == 1 ? pixel.g : pixel.b;
+                        squared_error += (expected - actual) * (expected - actual);
+                    }
+                }
+            }
+            // The noise of the source is lost to chroma subsampling, so only
+            // full-resolution frames get close to it.
+            double psnr = 10 * std::log10(255. * 255 * width * height * 3 / squared_error);
+            REQUIRE(psnr > previous_psnr);
+            previous_psnr = psnr;
+        }
+        if (subsampling == Subsampling::kGray || subsampling == Subsampling::k444) {
+            REQUIRE(previous_psnr > 35);
+        }
+    }
+}
+
+TEST_CASE("decode cost calibration", "[jpg]") {
+    auto model = CalibrateDecodeCost(1 << 14);
+    REQUIRE(model.fixed_seconds >= 0);
+    REQUIRE(model.per_pixel >= 0);
+    REQUIRE(model.per_block >= 0);
+    REQUIRE(model.per_byte >= 0);
+    REQUIRE(model.fixed_seconds + model.per_pixel + model.per_block + model.per_byte > 0);
+
+    auto data = EncodeSynthetic(147, 111, Subsampling::k420);
+    std::istringstream input(data);
+    FrameInfo frame;
+    REQUIRE(ReadFrameInfo(input, data.size(), frame) == DecodeStatus::kOk);
+    REQUIRE(frame.supported);
+    REQUIRE(!frame.progressive);
+    REQUIRE(frame.width == 147);
+    REQUIRE(frame.hor_sampling == 2);
+    REQUIRE(EstimateDecodeCost(frame, model).seconds > 0);
+}
+
+TEST_CASE("decode control", "[jpg]") {
+    // A 16x32 grayscale frame without tables, the limits are checked before
+    // the image is allocated and the scan is read.
+    std::string header(
+        "\xff\xd8\xff\xc0\x00\x0b\x08\x00\x20\x00\x10\x01\x01\x11\x00"
+        "\xff\xda\x00\x08\x01\x01\x00\x00\x3f\x00",
+        25);
+    auto status = [&](const DecodeControl &control) {
+        std::istringstream input(header);
+        return TryDecode(input, control).status;
+    };
+    DecodeControl control;
+    REQUIRE(status(control) == DecodeStatus::kBadHuffmanTable);
+
+    CancellationToken token;
+    token.Cancel();
+    control.cancel = &token;
+    REQUIRE(status(control) == DecodeStatus::kCancelled);
+
+    control = DecodeControl();
+    control.deadline = std::chrono::steady_clock::now();
+    REQUIRE(status(control) == DecodeStatus::kDeadlineExceeded);
+
+    control = DecodeControl();
+    control.max_pixels = 16 * 32 - 1;
+    REQUIRE(status(control) == DecodeStatus::kLimitExceeded);
+    control.max_pixels = 16 * 32;
+    control.max_memory_bytes = 16 * 32;
+    REQUIRE(status(control) == DecodeStatus::kLimitExceeded);
+}
+
+TEST_CASE("parallel scan matches serial", "[jpg]") {
+    // No restart markers and a scan of several chunks, so every thread but the
+    // first decodes speculatively, the last one up to the end of the data.
+    auto data = EncodeSynthetic(1024, 768, Subsampling::k444, 95);
+    REQUIRE(data.size() > 4 * kMinChunkBytes);
+    auto decode = [&](size_t threads) {
+        std::istringstream input(data);
+        FrameCoefficients frame;
+        REQUIRE(ReadCoefficients(input, threads, frame) == DecodeStatus::kOk);
+        return frame.scan.blocks;
+    };
+    auto serial = decode(1);
+    for (size_t threads : {2, 3, 4, 7}) {
+        auto blocks = decode(threads);
+        REQUIRE(blocks.size() == serial.size());
+        REQUIRE(std::memcmp(blocks.data(), serial.data(), blocks.size() * sizeof(CoefBlock)) == 0);
+    }
+}
+
+TEST_CASE("mcu index regions", "[jpg]") {
+    // 4:2:0 with partial MCUs on the right and bottom edges.
+    for (size_t restart_interval : {0, 5}) {
+        auto data = EncodeSynthetic(203, 157, Subsampling::k420, 75, restart_interval);
+        uint64_t hash = HashBytes(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+        std::istringstream file(data);
+        auto built = BuildMcuIndex(file, 4);
+        REQUIRE(built.source_size == data.size());
+        REQUIRE(built.source_hash == hash);
+        std::stringstream sidecar;
+        WriteMcuIndex(built, sidecar);
+        auto index = ReadMcuIndex(sidecar, hash, data.size());
+        REQUIRE(index.entries.size() == built.entries.size());
+
+        std::istringstream full_input(data);
+        auto full = Decode(full_input);
+        struct Window {
+            size_t x, y, width, height;
+        };
+        for (auto [x, y, width, height] : {Window{0, 0, 16, 16}, Window{37, 50, 100, 60},
+                                           Window{192, 144, 11, 13}, Window{190, 150, 100, 100},
+                                           Window{0, 100, 203, 1}}) {
+            std::istringstream input(data);
+            auto region = DecodeRegion(input, index, x, y, width, height);
+            REQUIRE(region.Width() == std::min<size_t>(width, 203 - x));
+            REQUIRE(region.Height() == std::min<size_t>(height, 157 - y));
+            for (size_t row = 0; row < region.Height(); ++row) {
+                for (size_t col = 0; col < region.Width(); ++col) {
+                    auto expected = full.GetPixel(y + row, x + col);
+                    auto pixel = region.GetPixel(row, col);
+                    REQUIRE((pixel.r == expected.r && pixel.g == expected.g &&
+                             pixel.b == expected.b));
+                }
+            }
+        }
+
+        sidecar.clear();
+        sidecar.seekg(0);
+        REQUIRE_THROWS_AS(ReadMcuIndex(sidecar, hash + 1, data.size()), std::runtime_error);
+        auto shifted = index;
+        shifted.entries[1].file_bit_pos = 8 * (index.scan_end + 100);
+        std::istringstream input(data);
+        REQUIRE_THROWS_AS(DecodeRegion(input, shifted, 64, 0, 16, 16), std::runtime_error);
+        std::istringstream other(data + "trailing");
+        REQUIRE_THROWS_AS(DecodeRegion(other, index, 0, 0, 16, 16), std::runtime_error);
+    }
+}
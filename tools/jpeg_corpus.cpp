@@ -0,0 +1,183 @@
+// Writes a deterministic corpus of baseline jpegs for benchmarks and stress
+// tests. Every combination of the listed options becomes one file named after
+// its options, manifest.txt lists their sizes.
+//
+// jpeg_corpus <dir> [--megapixels 1,4,16] [--sampling gray,444,422,420]
+//     [--quality 50,75,95] [--restart 0,64] [--huffman standard,custom] [--seed 1]
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "jpeg_encoder.h"
+
+namespace {
+
+const std::map<std::string, Subsampling> kSamplings = {{"gray", Subsampling::kGray},
+                                                       {"444", Subsampling::k444},
+                                                       {"422", Subsampling::k422},
+                                                       {"420", Subsampling::k420}};
+
+std::vector<std::string> Split(const std::string &list) {
+    std::vector<std::string> items;
+    std::istringstream input(list);
+    for (std::string item; std::getline(input, item, ',');) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+// Numbers outside [min_value, max_value] throw std::invalid_argument.
+std::vector<size_t> SplitNumbers(const std::string &name, const std::string &list,
+                                 size_t min_value, size_t max_value) {
+    std::vector<size_t> numbers;
+    for (const auto &item : Split(list)) {
+        // At most 19 digits always fit a size_t.
+        if (item.size() > 19 || item.find_first_not_of("0123456789") != std::string::npos ||
+            std::stoull(item) < min_value || std::stoull(item) > max_value) {
+            throw std::invalid_argument("Bad " + name + " value " + item);
+        }
+        numbers.push_back(std::stoull(item));
+    }
+    return numbers;
+}
+
+// Every list of the command line, checked before the first file is written.
+struct CorpusOptions {
+    std::vector<size_t> megapixels;
+    std::vector<std::string> samplings;
+    std::vector<size_t> qualities;
+    std::vector<size_t> restarts;
+    std::vector<std::string> huffmans;
+    uint64_t seed = 1;
+};
+
+CorpusOptions ParseOptions(const std::map<std::string, std::string> &args) {
+    CorpusOptions options;
+    // The largest frame is 65535x65535, about 4295 MP.
+    options.megapixels = SplitNumbers("--megapixels", args.at("--megapixels"), 1, 4295);
+    options.samplings = Split(args.at("--sampling"));
+    for (const auto &sampling : options.samplings) {
+        if (!kSamplings.count(sampling)) {
+            throw std::invalid_argument("Bad --sampling value " + sampling);
+        }
+    }
+    options.qualities = SplitNumbers("--quality", args.at("--quality"), 1, 100);
+    options.restarts = SplitNumbers("--restart", args.at("--restart"), 0, 65535);
+    options.huffmans = Split(args.at("--huffman"));
+    for (const auto &huffman : options.huffmans) {
+        if (huffman != "standard" && huffman != "custom") {
+            throw std::invalid_argument("Bad --huffman value " + huffman);
+        }
+    }
+    options.seed = SplitNumbers("--seed", args.at("--seed"), 0, SIZE_MAX).at(0);
+    return options;
+}
+
+// 4:3 frame of about |megapixels|, the largest jpeg side is 65535.
+void FrameSize(size_t megapixels, size_t &width, size_t &height) {
+    double pixels = megapixels * 1e6;
+    width = std::min<size_t>(65535, std::llround(std::sqrt(pixels * 4 / 3)));
+    height = std::min<size_t>(65535, std::max<size_t>(1, std::llround(pixels / width)));
+}
+
+// Streams the file through a large buffer, a 400 MP jpeg is written in
+// pieces as it is encoded. Returns its size.
+size_t WriteJpeg(const std::string &path, const EncoderOptions &options, uint64_t seed) {
+    std::vector<char> buffer(1 << 20);
+    std::ofstream output;
+    output.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    output.open(path, std::ios::binary | std::ios::trunc);
+    if (!output) {
+        throw std::runtime_error("Can't write " + path);
+    }
+    EncodeJpeg(options,
+               MakeSyntheticSource(options.width, options.subsampling == Subsampling::kGray, seed),
+               output);
+    size_t bytes = output.tellp();
+    output.close();
+    if (!output) {
+        throw std::runtime_error("Can't write " + path);
+    }
+    return bytes;
+}
+
+int Usage() {
+    std::cerr << "Usage: jpeg_corpus <dir> [--megapixels 1,4,16] [--sampling gray,444,422,420] "
+                 "[--quality 50,75,95] [--restart 0,64] [--huffman standard,custom] [--seed 1]\n";
+    return 1;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc % 2 != 0) {
+        return Usage();
+    }
+    std::string dir = argv[1];
+    std::map<std::string, std::string> args = {{"--megapixels", "1,4,16"},
+                                               {"--sampling", "gray,444,422,420"},
+                                               {"--quality", "50,75,95"},
+                                               {"--restart", "0,64"},
+                                               {"--huffman", "standard,custom"},
+                                               {"--seed", "1"}};
+    for (int id = 2; id < argc; id += 2) {
+        if (!args.count(argv[id])) {
+            return Usage();
+        }
+        args[argv[id]] = argv[id + 1];
+    }
+
+    CorpusOptions corpus;
+    try {
+        corpus = ParseOptions(args);
+    } catch (const std::exception &error) {
+        std::cerr << error.what() << '\n';
+        return Usage();
+    }
+
+    try {
+        std::ofstream manifest(dir + "/manifest.txt");
+        if (!manifest) {
+            throw std::runtime_error("Can't write " + dir + "/manifest.txt");
+        }
+        for (size_t megapixels : corpus.megapixels) {
+            for (const auto &sampling : corpus.samplings) {
+                for (size_t quality : corpus.qualities) {
+                    for (size_t restart : corpus.restarts) {
+                        for (const auto &huffman : corpus.huffmans) {
+                            EncoderOptions options;
+                            FrameSize(megapixels, options.width, options.height);
+                            options.subsampling = kSamplings.at(sampling);
+                            options.quality = quality;
+                            options.restart_interval = restart;
+                            options.optimize_huffman = huffman == "custom";
+                            std::string name = "mp" + std::to_string(megapixels) + "_" +
+                                               sampling + "_q" + std::to_string(quality) + "_r" +
+                                               std::to_string(restart) + "_" + huffman + ".jpg";
+                            // Same seed for all options of a size, so files differ
+                            // only by how they are encoded.
+                            size_t bytes =
+                                WriteJpeg(dir + "/" + name, options, corpus.seed + megapixels);
+                            manifest << name << ' ' << options.width << ' ' << options.height
+                                     << ' ' << bytes << '\n';
+                            std::cout << name << ' ' << bytes << " bytes" << std::endl;
+                        }
+                    }
+                }
+            }
+        }
+    } catch (const std::exception &error) {
+        std::cerr << error.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
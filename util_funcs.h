@@ -31,10 +31,7 @@ std::vector<T> ZigZagRead(const Matrix88 &mat) {
     return result;
 }
 
-Matrix88 ZigZagConvert(const std::vector<int> &seq) {
-    if (seq.size() != 64) {
-        throw std::runtime_error("Bad size of sequence in ZigZagConvert");
-    }
+inline Matrix88 ZigZagConvert(const int *seq) {
     Matrix88 res;
     size_t cur_pos = 0;
     res.Get(0, 0) = seq[cur_pos++];
@@ -105,25 +102,7 @@ Matrix88 ZigZagConvert(const std::vector<int> &seq) {
     return res;
 }
 
-void FillWithCnt(std::vector<int> &result, const std::pair<int, int> &pr) {
-    auto [cnt, val] = pr;
-    if (cnt == -1 && val == -1) {
-        while (result.size() != 64) {
-            result.push_back(0);
-        }
-        return;
-    }
-    while (cnt--) {
-        result.push_back(0);
-    }
-    result.push_back(val);
-    if (result.size() > 64) {
-        throw std::runtime_error("Size of matrix exceeded 64 in FillWithCnt, actual size = " +
-                                 std::to_string(result.size()));
-    }
-}
-
-RGB ConvertYCbCrToRGB(const YCbCr &pix) {
+inline RGB ConvertYCbCrToRGB(const YCbCr &pix) {
     RGB res;
     res.r = (pix.y + 1.402 * (pix.cr - 128));
     res.g = (pix.y - (0.114 * 1.772 * (pix.cb - 128) + 0.299 * 1.402 * (pix.cr - 128)) / 0.587);
@@ -135,7 +114,7 @@ RGB ConvertYCbCrToRGB(const YCbCr &pix) {
     return res;
 }
 
-void PrintQuantTableInfo(const QuantTable &tab) {
+inline void PrintQuantTableInfo(const QuantTable &tab) {
     std::cout << std::string(100, '-') << std::endl;
     std::cout << "Table id = " << tab.table_dest << std::endl;
     std::cout << "Table size = " << tab.kTableSize << std::endl;
@@ -148,7 +127,7 @@ void PrintQuantTableInfo(const QuantTable &tab) {
     std::cout << std::string(100, '-') << std::endl;
 }
 
-void MultiplyMatrixByElements(Matrix88 &fir, const Matrix88 &sec) {
+inline void MultiplyMatrixByElements(Matrix88 &fir, const Matrix88 &sec) {
     for (size_t y = 0; y < 8; ++y) {
         for (size_t x = 0; x < 8; ++x) {
             fir.Get(y, x) *= sec.Get(y, x);
@@ -156,8 +135,8 @@ void MultiplyMatrixByElements(Matrix88 &fir, const Matrix88 &sec) {
     }
 }
 
-void ConvertMatrix(Matrix88 &mat, DctCalculator &dct_calc, std::vector<double> *input,
-                   std::vector<double> *output) {
+inline void ConvertMatrix(Matrix88 &mat, DctCalculator &dct_calc, std::vector<double> *input,
+                          std::vector<double> *output) {
     std::vector<double> els(64);
     for (size_t y = 0; y < 8; ++y) {
         for (size_t x = 0; x < 8; ++x) {
@@ -175,7 +154,7 @@ void ConvertMatrix(Matrix88 &mat, DctCalculator &dct_calc, std::vector<double> *
     }
 }
 
-void PrintFrameInfo(const FrameParametrs &frame) {
+inline void PrintFrameInfo(const FrameParametrs &frame) {
     std::cout << std::string(100, '-') << std::endl;
     std::cout << "Quant table dest = " << frame.qtable_dest << std::endl;
     std::cout << "Table AC dest = " << frame.ac_huff_dest << std::endl;
@@ -186,13 +165,13 @@ void PrintFrameInfo(const FrameParametrs &frame) {
     std::cout << std::string(100, '-') << std::endl;
 }
 
-void PrintHuffmanInfo(const HuffTabParametrs &huff) {
+inline void PrintHuffmanInfo(const HuffTabParametrs &huff) {
     std::cout << std::string(100, '-') << std::endl;
     std::cout << "Huff table_ID = " << huff.table_id << std::endl;
     std::cout << "Huff table_class = " << huff.table_class << std::endl;
-    std::cout << "Huff code count = " << huff.values.size() << std::endl;
-    for (auto el : huff.values) {
-        std::cout << static_cast<uint32_t>(el) << " ";
+    std::cout << "Huff code count = " << huff.huffman->Size() << std::endl;
+    for (size_t id = 0; id < huff.huffman->Size(); ++id) {
+        std::cout << static_cast<uint32_t>(huff.huffman->Values()[id]) << " ";
     }
     std::cout << std::endl;
     std::cout << std::string(100, '-') << std::endl;